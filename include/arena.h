@@ -0,0 +1,41 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifndef RBH_FSEVENTS_ARENA_H
+#define RBH_FSEVENTS_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <robinhood/sstack.h>
+
+/* A queue of regions of memory, released in the order they were allocated
+ *
+ * A source allocates the fsevents it yields in an arena, tagged with its
+ * position, and releases them once that position is acknowledged. Memory is
+ * released one region at a time, a region usually spans the fsevents read in
+ * between two acknowledgements.
+ *
+ * A single thread may allocate from an arena, any one thread may release it.
+ */
+struct arena;
+
+/* \p chunk_size is that of the stacks regions are made of */
+struct arena *
+arena_new(size_t chunk_size);
+
+/* Stack to allocate memory for the fsevents at \p position in
+ *
+ * Positions only ever increase. The stack is valid until the next call to
+ * arena_values(), and what is pushed on it until \p position is released.
+ */
+struct rbh_sstack *
+arena_values(struct arena *arena, uint64_t position);
+
+/* Release the memory of every position up to \p position */
+void
+arena_release(struct arena *arena, uint64_t position);
+
+void
+arena_destroy(struct arena *arena);
+
+#endif
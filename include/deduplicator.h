@@ -3,13 +3,117 @@
 #ifndef DEDUPLICATOR_H
 #define DEDUPLICATOR_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
+#include <robinhood/fsevent.h>
 #include <robinhood/iterator.h>
 
 #include "source.h"
 
+struct deduplicator_stats;
+
+struct deduplicator_options {
+    /* Maximum number of fsevents in a batch */
+    size_t batch_size;
+    /* Maximum delay between the moment the first fsevent of a batch occurred
+     * and the moment the batch is flushed, a zero delay means "no limit".
+     */
+    struct timespec max_delay;
+    /* Minimum number of fsevents in a batch before max_delay is considered.
+     *
+     * This lets the deduplicator catch up with a large backlog of fsevents
+     * instead of processing them a few at a time. Sources signal they have
+     * nothing more to yield immediately with ENODATA, in which case a batch
+     * is flushed regardless of its size.
+     */
+    size_t min_batch_size;
+    /* Maximum number of bytes the fsevents of a batch may use before it is
+     * flushed, zero means "no limit".
+     *
+     * This accounts for every fsevent a batch retains (ids, names, xattrs,
+     * statx, ...), not for the memory the source or enrichers use.
+     */
+    size_t max_memory;
+    /* Number of threads fsevents are deduplicated on, each of them handles
+     * a distinct subset of the ids. With less than 2 shards, fsevents are
+     * deduplicated by the thread that reads them from the source.
+     */
+    size_t shards;
+    /* Directory where batches that reach max_memory move the fsevents they
+     * did not update recently, instead of being flushed. NULL means batches
+     * never overflow to disk, it cannot be used with several shards.
+     *
+     * Spilled fsevents are deduplicated again, in memory, once the batch is
+     * flushed.
+     */
+    const char *spill_directory;
+    /* Instead of cutting the stream of fsevents in batches, hold each id for
+     * max_delay after its first fsevent occurred, and then release it in the
+     * next batch. Ids are released in a batch until it holds batch_size
+     * fsevents, it is yielded as soon as it holds min_batch_size fsevents and
+     * no other id is due.
+     *
+     * This requires a max_delay, and cannot be used with several shards or a
+     * spill directory. When max_memory is set, the ids held the longest are
+     * released early to stay under it.
+     */
+    bool sliding;
+    /* Called with the statistics of every batch right before it is yielded,
+     * on the thread that reads the source. May be NULL.
+     */
+    void (*report)(const struct deduplicator_stats *batch);
+};
+
+/* Group the fsevents of \p source in batches, as configured by \p options.
+ *
+ * In each batch, fsevents that target the same id are grouped together and
+ * merged whenever possible. Batches are iterators of fsevents which remain
+ * valid until the batch is destroyed.
+ */
 struct rbh_mut_iterator *
-deduplicator_new(size_t count, struct source *source);
+deduplicator_new(const struct deduplicator_options *options,
+                 struct source *source);
+
+/* Checkpoint of the source to acknowledge once the batches \p batches yielded
+ * so far are processed.
+ *
+ * Without a sliding window, this is the checkpoint of the source.
+ */
+uint64_t
+deduplicator_checkpoint(struct rbh_mut_iterator *batches);
+
+/* Number of values of enum rbh_fsevent_type */
+#define FSEVENT_TYPE_COUNT (RBH_FET_XATTR + 1)
+
+struct deduplicator_stats {
+    /* Fsevents read from the source, and yielded in batches, per type */
+    size_t in[FSEVENT_TYPE_COUNT];
+    size_t out[FSEVENT_TYPE_COUNT];
+    /* Fsevents merged into a previous one of the same id */
+    size_t merged;
+    /* Fsevents whose partial fields were all moved to a previous one of the
+     * same id, and which had nothing left to update
+     */
+    size_t hoisted;
+    /* Updates of the timestamps of an entry (typically a parent directory)
+     * that were folded into a previous one of the same batch
+     */
+    size_t acmtime_folded;
+    /* Links cancelled by an unlink of the same namespace entry */
+    size_t links_cancelled;
+    /* Fsevents superseded by the deletion of their entry */
+    size_t superseded;
+    /* Entries created and deleted in the same batch */
+    size_t temporary;
+    /* Number of fsevents moved to disk because a batch used too much memory */
+    size_t spilled;
+};
+
+/* Statistics of every deduplicator since the program started */
+void
+deduplicator_get_stats(struct deduplicator_stats *stats);
 
 #endif
@@ -3,6 +3,8 @@
 #ifndef ENRICHER_H
 #define ENRICHER_H
 
+#include <time.h>
+
 #include <robinhood/backend.h>
 #include <robinhood/iterator.h>
 
@@ -42,4 +44,35 @@ enrich_iter_builder_from_backend(struct rbh_backend *rbh_backend,
 struct rbh_iterator *
 iter_no_partial(struct rbh_iterator *fsevents);
 
+/* Enrichers remember the ids they failed to open because they no longer
+ * exist, and skip their fsevents for \p ttl (a zero \p ttl disables this).
+ */
+void
+enrich_set_negative_ttl(const struct timespec *ttl);
+
+/* Free the memory the enrichers of the calling thread allocated for the
+ * fsevents they yielded so far, which must not be used anymore.
+ *
+ * Otherwise, that memory is only freed when the program exits.
+ */
+void
+enrich_reset(void);
+
+struct enrich_stats {
+    /* Number of times an enricher needed a descriptor to an entry */
+    size_t lookups;
+    /* ... and found it in its descriptor cache */
+    size_t fd_hits;
+    /* ... and knew the entry did not exist anymore */
+    size_t negative_hits;
+    /* ... and had to open it */
+    size_t opens;
+    /* Number of fsevents skipped because their entry no longer exists */
+    size_t skipped;
+};
+
+/* Statistics of every enricher since the program started */
+void
+enrich_get_stats(struct enrich_stats *stats);
+
 #endif
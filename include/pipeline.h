@@ -0,0 +1,44 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifndef RBH_FSEVENTS_PIPELINE_H
+#define RBH_FSEVENTS_PIPELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <robinhood/iterator.h>
+
+#include "enricher.h"
+#include "sink.h"
+#include "source.h"
+
+struct pipeline {
+    /* Batches of fsevents read from source, eg. a deduplicator */
+    struct rbh_mut_iterator *batches;
+    /* Checkpoint of the source to acknowledge once the batches read so far
+     * are processed, NULL if that is the checkpoint of the source.
+     */
+    uint64_t (*checkpoint)(struct rbh_mut_iterator *batches);
+    struct source *source;
+    /* NULL if fsevents are not to be enriched */
+    struct enrich_iter_builder *builder;
+    bool allow_partials;
+    struct sink *sink;
+    /* Called once every batch is acknowledged, NULL if not needed */
+    void (*report)(void);
+};
+
+/* Read, enrich and send every batch of \p pipeline to its sink, then
+ * acknowledge them with the source.
+ *
+ * With a single thread, each batch goes through every stage before the next
+ * one is read. With more threads, stages run concurrently on consecutive
+ * batches: the next batch is read and deduplicated while the current one is
+ * enriched and the previous one is processed by the sink.
+ *
+ * Errors are fatal.
+ */
+void
+pipeline_run(struct pipeline *pipeline, unsigned int threads);
+
+#endif
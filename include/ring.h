@@ -0,0 +1,38 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifndef RBH_FSEVENTS_RING_H
+#define RBH_FSEVENTS_RING_H
+
+#include <stddef.h>
+
+/* A bounded, lock-free, single producer / single consumer queue of pointers
+ *
+ * Exactly one thread may push to a ring, and exactly one thread may pop from
+ * it. Both operations block (without holding any lock) until they can be
+ * completed.
+ */
+struct ring;
+
+/* \p size is rounded up to the next power of 2 */
+struct ring *
+ring_new(size_t size);
+
+void
+ring_push(struct ring *ring, void *item);
+
+void *
+ring_pop(struct ring *ring);
+
+/* Number of items in \p ring
+ *
+ * This is only meaningful to the producer, for which it may only be an
+ * overestimate, and to the consumer, for which it may only be an
+ * underestimate.
+ */
+size_t
+ring_length(struct ring *ring);
+
+void
+ring_destroy(struct ring *ring);
+
+#endif
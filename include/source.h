@@ -3,21 +3,100 @@
 #ifndef RBH_FSEVENTS_SOURCE_H
 #define RBH_FSEVENTS_SOURCE_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
 #include <robinhood/iterator.h>
 
+struct source_operations {
+    /* Time at which the last fsevent yielded by the source occurred */
+    void (*timestamp)(void *source, struct timespec *timestamp);
+    /* Position of the source right after the last fsevent it yielded
+     *
+     * Positions only ever increase, and the fsevents of a record are
+     * accounted for only once every one of them was yielded.
+     */
+    uint64_t (*checkpoint)(void *source);
+    /* Let the source know every fsevent up to \p checkpoint was processed
+     * durably, and that it can forget about them.
+     */
+    int (*acknowledge)(void *source, uint64_t checkpoint);
+};
+
 struct source {
     struct rbh_iterator fsevents;
     const char *name;
+    const struct source_operations *ops;
+    /* Whether the fsevents the source yields stay valid until they are
+     * acknowledged, rather than only until the next one is read
+     *
+     * Only the fsevents themselves need to be copied then, not what they point
+     * to.
+     */
+    bool retains;
 };
 
+/* Sources which do not know when an fsevent occurred default to the time it
+ * was read, ie. now.
+ */
+static inline void
+source_timestamp(struct source *source, struct timespec *timestamp)
+{
+    if (source->ops == NULL || source->ops->timestamp == NULL) {
+        clock_gettime(CLOCK_REALTIME, timestamp);
+        return;
+    }
+    source->ops->timestamp(source, timestamp);
+}
+
+static inline uint64_t
+source_checkpoint(struct source *source)
+{
+    if (source->ops == NULL || source->ops->checkpoint == NULL)
+        return 0;
+    return source->ops->checkpoint(source);
+}
+
+static inline int
+source_acknowledge(struct source *source, uint64_t checkpoint)
+{
+    if (source->ops == NULL || source->ops->acknowledge == NULL)
+        return 0;
+    return source->ops->acknowledge(source, checkpoint);
+}
+
 struct source *
 source_from_file(FILE *file);
 
+/* How far ahead of the fsevents it yields a changelog is read */
+struct prefetch_options {
+    /* Maximum number of records read ahead, zero means records are read on
+     * demand, by the thread that reads the source.
+     */
+    size_t depth;
+    /* Once high records are read ahead, reading stops until no more than low
+     * of them are left.
+     */
+    size_t high;
+    size_t low;
+};
+
+/* If \p username is not NULL, records are cleared from the changelog of
+ * \p mdtname on behalf of that changelog user as they are acknowledged.
+ *
+ * \p record_types is a comma separated list of the types of records to
+ * process (eg. "CREAT,UNLNK"), other records are skipped. If it is NULL, every
+ * type of record fsevents can be built for is processed.
+ *
+ * Records are read ahead on a thread of their own, as configured by
+ * \p prefetch.
+ */
 struct source *
-source_from_lustre_changelog(const char *mdtname);
+source_from_lustre_changelog(const char *mdtname, const char *username,
+                             const char *record_types,
+                             const struct prefetch_options *prefetch);
 
 #endif
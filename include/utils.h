@@ -0,0 +1,59 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifndef RBH_FSEVENTS_UTILS_H
+#define RBH_FSEVENTS_UTILS_H
+
+#include <stdbool.h>
+
+#include <robinhood/fsevent.h>
+#include <robinhood/sstack.h>
+#include <robinhood/statx.h>
+
+/* Chunk size of the stacks fsevents are copied into.
+ *
+ * rbh_sstack_push() cannot allocate more than a chunk at once, this must be
+ * large enough to hold any single field of an fsevent (the Linux VFS limits
+ * xattr values to 64KiB).
+ */
+#define FSEVENT_COPY_CHUNK_SIZE (1 << 20)
+
+/* Override the fields of \p original with those set in \p override */
+void
+merge_statx(struct rbh_statx *original, const struct rbh_statx *override);
+
+/* Hash tables of ids should store this along with each id, and only compare
+ * ids whose hashes are equal.
+ */
+size_t
+id_hash(const struct rbh_id *id);
+
+bool
+id_equal(const struct rbh_id *first, const struct rbh_id *second);
+
+/* Deep copy \p src into \p dest, allocating everything it points at on
+ * \p values.
+ *
+ * \p dest may not point at any memory from \p src once this function returns.
+ * It remains valid as long as \p values is not popped nor destroyed.
+ */
+int
+fsevent_copy(struct rbh_fsevent *dest, const struct rbh_fsevent *src,
+             struct rbh_sstack *values);
+
+struct rbh_id *
+id_copy(const struct rbh_id *id, struct rbh_sstack *values);
+
+int
+value_map_copy(struct rbh_value_map *dest, const struct rbh_value_map *src,
+               struct rbh_sstack *values);
+
+/* Number of bytes fsevent_copy() and value_map_copy() push on their stack to
+ * copy \p fsevent and \p map respectively.
+ */
+size_t
+fsevent_size(const struct rbh_fsevent *fsevent);
+
+size_t
+value_map_size(const struct rbh_value_map *map);
+
+#endif
@@ -22,6 +22,7 @@
 
 #include "deduplicator.h"
 #include "enricher.h"
+#include "pipeline.h"
 #include "source.h"
 #include "sink.h"
 
@@ -31,12 +32,19 @@ enum rbh_source_t {
     SRC_LUSTRE,
 };
 
+#define DEFAULT_BATCH_SIZE ((size_t)100)
+
 static void
 usage(void)
 {
     /* TODO: accept source as a URI or a '-', like src:lustre:lustre-MDT0000. */
     const char *message =
-        "usage: %s [-h] [--raw] [--enrich MOUNTPOINT] [--lustre] SOURCE DESTINATION\n"
+        "usage: %s [-h] [--raw] [--enrich MOUNTPOINT] [--lustre] [--batch-size COUNT]\n"
+        "       [--batch-stats] [--max-delay SECONDS] [--min-batch-size COUNT]\n"
+        "       [--max-memory SIZE] [--negative-ttl SECONDS] [--prefetch COUNT]\n"
+        "       [--prefetch-watermarks LOW:HIGH] [--record-types TYPES]\n"
+        "       [--shards COUNT] [--spill-dir DIRECTORY] [--sliding-window] [--stats]\n"
+        "       [--threads COUNT] [--user USERNAME] SOURCE DESTINATION\n"
         "\n"
         "Collect changelog records from SOURCE, optionally enrich them with data\n"
         "collected from MOUNTPOINT and send them to DESTINATION.\n"
@@ -50,32 +58,97 @@ usage(void)
         "                        a RobinHood URI (eg. rbh:mongo:test).\n"
         "\n"
         "Optional arguments:\n"
+        "    -b, --batch-size COUNT\n"
+        "                    deduplicate fsevents in batches of at most COUNT fsevents\n"
+        "                    (default: %zu)\n"
+        "    -B, --batch-stats\n"
+        "                    print how every batch was deduplicated, and enriched,\n"
+        "                    on standard error\n"
+        "    -D, --spill-dir DIRECTORY\n"
+        "                    once batches reach --max-memory, move the fsevents they\n"
+        "                    did not update recently to a file in DIRECTORY instead\n"
+        "                    of flushing them, not with --shards (default: none)\n"
+        "    -d, --max-delay SECONDS\n"
+        "                    flush a batch at the latest SECONDS after its first\n"
+        "                    fsevent occurred, 0 means no limit (default: 0)\n"
         "    -h, --help      print this message and exit\n"
         "    -r, --raw       do not enrich changelog records (default)\n"
         "    -e, --enrich MOUNTPOINT\n"
         "                    enrich changelog records by querying MOUNTPOINT as needed\n"
         "                    MOUNTPOINT is a RobinHood URI (eg. rbh:lustre:/mnt/lustre)\n"
         "    -l, --lustre    consider SOURCE is an MDT name\n"
+        "    -M, --max-memory SIZE\n"
+        "                    flush batches once their fsevents use SIZE bytes, SIZE\n"
+        "                    may be suffixed with K, M or G (default: no limit)\n"
+        "    -m, --min-batch-size COUNT\n"
+        "                    ignore --max-delay until batches hold at least COUNT\n"
+        "                    fsevents, unless the source runs out of fsevents\n"
+        "                    (default: 0)\n"
+        "    -n, --negative-ttl SECONDS\n"
+        "                    skip the fsevents of entries the enricher found missing\n"
+        "                    for SECONDS, 0 disables this (default: 10)\n"
+        "    -p, --prefetch COUNT\n"
+        "                    read up to COUNT changelog records ahead on a thread of\n"
+        "                    their own, 0 disables this, only with --lustre\n"
+        "                    (default: 0)\n"
+        "    -P, --prefetch-watermarks LOW:HIGH\n"
+        "                    once HIGH records are read ahead, wait until no more\n"
+        "                    than LOW are left before reading more, only with\n"
+        "                    --prefetch (default: half of --prefetch:--prefetch)\n"
+        "    -T, --record-types TYPES\n"
+        "                    only process changelog records of TYPES, a comma\n"
+        "                    separated list of Lustre record types (eg. CREAT,UNLNK),\n"
+        "                    only with --lustre (default: every type supported)\n"
+        "    -S, --shards COUNT\n"
+        "                    deduplicate fsevents on COUNT threads, each of them\n"
+        "                    handling a distinct subset of the entries (default: 1)\n"
+        "    -s, --stats     print statistics on standard error before exiting\n"
+        "    -t, --threads COUNT\n"
+        "                    run the stages of the processing on up to COUNT threads:\n"
+        "                    with 2 threads, the source is read and deduplicated on\n"
+        "                    its own thread, with 3 or more, fsevents are also\n"
+        "                    enriched in parallel on COUNT - 2 threads (default: 1)\n"
+        "    -u, --user USERNAME\n"
+        "                    clear changelog records on behalf of USERNAME (eg. cl1)\n"
+        "                    once they are processed, only with --lustre\n"
+        "    -w, --sliding-window\n"
+        "                    hold each entry for --max-delay after its first fsevent\n"
+        "                    instead of cutting fsevents in batches, entries are\n"
+        "                    then released individually, not with --shards nor\n"
+        "                    --spill-dir\n"
         "\n"
         "Note that uploading raw records to a RobinHood backend will fail, they have to\n"
         "be enriched first.\n";
 
-    printf(message, program_invocation_short_name);
+    printf(message, program_invocation_short_name, DEFAULT_BATCH_SIZE);
 }
 
 static struct source *
-source_new(const char *arg, enum  rbh_source_t source_type)
+source_new(const char *arg, enum  rbh_source_t source_type,
+           const char *username, const char *record_types,
+           const struct prefetch_options *prefetch)
 {
     FILE *file;
 
     switch(source_type) {
     case SRC_LUSTRE:
 #ifdef HAVE_LUSTRE
-        return source_from_lustre_changelog(arg);
+        return source_from_lustre_changelog(arg, username, record_types,
+                                            prefetch);
 #else
         error(EX_USAGE, EINVAL, "MDT source is not available");
+        __builtin_unreachable();
 #endif
     case SRC_FILE:
+        if (username != NULL)
+            error(EX_USAGE, EINVAL,
+                  "--user only makes sense with an MDT source");
+        if (record_types != NULL)
+            error(EX_USAGE, EINVAL,
+                  "--record-types only makes sense with an MDT source");
+        if (prefetch->depth != 0)
+            error(EX_USAGE, EINVAL,
+                  "--prefetch only makes sense with an MDT source");
         break;
     default:
         __builtin_unreachable();
@@ -213,8 +286,6 @@ mount_fd_exit(void)
         close(mount_fd);
 }
 
-static const size_t BATCH_SIZE = 1;
-
 static struct rbh_backend *enrich_point;
 
 static void __attribute__((destructor))
@@ -224,44 +295,222 @@ destroy_enrich_point(void)
         rbh_backend_destroy(enrich_point);
 }
 
-static void
-feed(struct sink *sink, struct source *source,
-     struct enrich_iter_builder *builder, bool allow_partials)
+/* Zero is a valid count */
+static size_t
+parse_count_or_zero(const char *arg)
 {
-    struct rbh_mut_iterator *deduplicator;
+    unsigned long long count;
+    char *end;
 
-    deduplicator = deduplicator_new(BATCH_SIZE, source);
-    if (deduplicator == NULL)
-        error(EXIT_FAILURE, errno, "deduplicator_new");
+    errno = 0;
+    count = strtoull(arg, &end, 0);
+    if (errno || *arg == '-' || end == arg || *end != '\0' || count > SIZE_MAX)
+        error(EX_USAGE, errno ? errno : EINVAL, "invalid count: %s", arg);
 
-    while (true) {
-        struct rbh_iterator *fsevents;
+    return count;
+}
 
-        errno = 0;
-        fsevents = rbh_mut_iter_next(deduplicator);
-        if (fsevents == NULL)
-            break;
+static size_t
+parse_count(const char *arg)
+{
+    size_t count = parse_count_or_zero(arg);
 
-        if (builder != NULL)
-            fsevents = enrich_iter_builder_build_iter(builder, fsevents);
-        else if (!allow_partials)
-            fsevents = iter_no_partial(fsevents);
+    if (count == 0)
+        error(EX_USAGE, EINVAL, "invalid count: %s", arg);
 
-        if (fsevents == NULL)
-            error(EXIT_FAILURE, errno, "iter_enrich");
+    return count;
+}
 
-        /* If we couldn't open the file because it is already deleted (ESTALE or
-         * ENOENT are both possible, depending of the event), just ignore the
-         * error and manage the next record instead of quitting
-         */
-        if (sink_process(sink, fsevents) && errno != ESTALE && errno != ENOENT)
-            error(EXIT_FAILURE, errno, "sink_process");
+static size_t
+parse_size(const char *arg)
+{
+    unsigned long long size;
+    unsigned int shift = 0;
+    char *end;
+
+    errno = 0;
+    size = strtoull(arg, &end, 0);
+    switch (*end) {
+    case 'G':
+        shift += 10;
+        __attribute__((fallthrough));
+    case 'M':
+        shift += 10;
+        __attribute__((fallthrough));
+    case 'K':
+        shift += 10;
+        end++;
+        break;
+    }
+
+    if (errno || *arg == '-' || end == arg || *end != '\0' || size == 0
+     || size > (SIZE_MAX >> shift))
+        error(EX_USAGE, errno ? errno : EINVAL, "invalid size: %s", arg);
 
-        rbh_iter_destroy(fsevents);
+    return size << shift;
+}
+
+/* LOW:HIGH */
+static void
+parse_watermarks(const char *arg, struct prefetch_options *prefetch)
+{
+    unsigned long long low, high;
+    const char *colon;
+    char *end;
+
+    errno = 0;
+    low = strtoull(arg, &end, 0);
+    if (errno || *arg == '-' || end == arg || *end != ':')
+        goto out_einval;
+
+    colon = end;
+    high = strtoull(colon + 1, &end, 0);
+    if (errno || colon[1] == '-' || end == colon + 1 || *end != '\0'
+     || high == 0 || low > high || high > SIZE_MAX)
+        goto out_einval;
+
+    prefetch->low = low;
+    prefetch->high = high;
+    return;
+
+out_einval:
+    error(EX_USAGE, errno ? errno : EINVAL, "invalid watermarks: %s", arg);
+    __builtin_unreachable();
+}
+
+static struct timespec
+parse_delay(const char *arg)
+{
+    struct timespec delay;
+    double seconds;
+    char *end;
+
+    errno = 0;
+    seconds = strtod(arg, &end);
+    if (errno || end == arg || *end != '\0' || !(seconds >= 0)
+     || seconds > (double)INT_MAX)
+        error(EX_USAGE, errno ? errno : EINVAL, "invalid delay: %s", arg);
+
+    delay.tv_sec = seconds;
+    delay.tv_nsec = (seconds - delay.tv_sec) * 1000000000;
+    return delay;
+}
+
+static double
+percent(size_t part, size_t total)
+{
+    return total ? 100. * part / total : 0.;
+}
+
+static const char *FSEVENT_TYPE_NAMES[FSEVENT_TYPE_COUNT] = {
+    [RBH_FET_UPSERT] = "upsert",
+    [RBH_FET_LINK] = "link",
+    [RBH_FET_UNLINK] = "unlink",
+    [RBH_FET_DELETE] = "delete",
+    [RBH_FET_XATTR] = "xattr",
+};
+
+static void
+deduplication_print(const char *label, const struct deduplicator_stats *stats)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    for (size_t i = 0; i < FSEVENT_TYPE_COUNT; i++) {
+        in += stats->in[i];
+        out += stats->out[i];
     }
 
-    if (errno != ENODATA)
-        error(EXIT_FAILURE, errno, "getting the next batch of fsevents");
+    fprintf(stderr, "%s: %zu fsevents in, %zu out (%.1f%% saved)", label, in,
+            out, in > out ? percent(in - out, in) : 0.);
+    for (size_t i = 0; i < FSEVENT_TYPE_COUNT; i++)
+        fprintf(stderr, ", %s %zu/%zu", FSEVENT_TYPE_NAMES[i], stats->in[i],
+                stats->out[i]);
+    fprintf(stderr,
+            "; %zu merged, %zu hoisted, %zu timestamp updates folded, "
+            "%zu links cancelled, %zu superseded by a deletion, "
+            "%zu temporary entries, %zu fsevents spilled\n",
+            stats->merged, stats->hoisted, stats->acmtime_folded,
+            stats->links_cancelled, stats->superseded, stats->temporary,
+            stats->spilled);
+}
+
+static void
+enrichment_print(const char *label, const struct enrich_stats *stats)
+{
+    fprintf(stderr,
+            "%s: %zu lookups, %zu descriptor cache hits (%.1f%%), "
+            "%zu negative cache hits (%.1f%%), %zu opens, "
+            "%zu fsevents skipped\n",
+            label, stats->lookups, stats->fd_hits,
+            percent(stats->fd_hits, stats->lookups), stats->negative_hits,
+            percent(stats->negative_hits, stats->lookups), stats->opens,
+            stats->skipped);
+}
+
+static void
+batch_report(const struct deduplicator_stats *stats)
+{
+    deduplication_print("batch", stats);
+}
+
+/* Enrichment statistics are global: with enrichment threads, the next batches
+ * may already be partly accounted for when a batch is reported.
+ */
+static void
+batch_enrichment_report(void)
+{
+    static struct enrich_stats previous;
+    struct enrich_stats current;
+    struct enrich_stats batch;
+
+    enrich_get_stats(&current);
+    batch.lookups = current.lookups - previous.lookups;
+    batch.fd_hits = current.fd_hits - previous.fd_hits;
+    batch.negative_hits = current.negative_hits - previous.negative_hits;
+    batch.opens = current.opens - previous.opens;
+    batch.skipped = current.skipped - previous.skipped;
+    previous = current;
+
+    enrichment_print("batch enrichment", &batch);
+}
+
+static void
+stats_print(void)
+{
+    struct deduplicator_stats deduplicator;
+    struct enrich_stats enrich;
+
+    deduplicator_get_stats(&deduplicator);
+    deduplication_print("deduplication", &deduplicator);
+
+    enrich_get_stats(&enrich);
+    enrichment_print("enrichment", &enrich);
+}
+
+static void
+feed(struct sink *sink, struct source *source,
+     struct enrich_iter_builder *builder, bool allow_partials,
+     const struct deduplicator_options *options, unsigned int threads)
+{
+    struct rbh_mut_iterator *deduplicator;
+    struct pipeline pipeline;
+
+    deduplicator = deduplicator_new(options, source);
+    if (deduplicator == NULL)
+        error(EXIT_FAILURE, errno, "deduplicator_new");
+
+    pipeline.batches = deduplicator;
+    pipeline.checkpoint = deduplicator_checkpoint;
+    pipeline.source = source;
+    pipeline.builder = builder;
+    pipeline.allow_partials = allow_partials;
+    pipeline.sink = sink;
+    /* --batch-stats also reports how every batch was enriched */
+    pipeline.report = NULL;
+    if (options->report != NULL && builder != NULL)
+        pipeline.report = batch_enrichment_report;
+    pipeline_run(&pipeline, threads);
 
     rbh_mut_iter_destroy(deduplicator);
 }
@@ -270,6 +519,20 @@ int
 main(int argc, char *argv[])
 {
     const struct option LONG_OPTIONS[] = {
+        {
+            .name = "batch-size",
+            .has_arg = required_argument,
+            .val = 'b',
+        },
+        {
+            .name = "batch-stats",
+            .val = 'B',
+        },
+        {
+            .name = "max-delay",
+            .has_arg = required_argument,
+            .val = 'd',
+        },
         {
             .name = "enrich",
             .has_arg = required_argument,
@@ -283,18 +546,99 @@ main(int argc, char *argv[])
             .name = "lustre",
             .val = 'l',
         },
+        {
+            .name = "max-memory",
+            .has_arg = required_argument,
+            .val = 'M',
+        },
+        {
+            .name = "min-batch-size",
+            .has_arg = required_argument,
+            .val = 'm',
+        },
+        {
+            .name = "negative-ttl",
+            .has_arg = required_argument,
+            .val = 'n',
+        },
+        {
+            .name = "prefetch",
+            .has_arg = required_argument,
+            .val = 'p',
+        },
+        {
+            .name = "prefetch-watermarks",
+            .has_arg = required_argument,
+            .val = 'P',
+        },
         {
             .name = "raw",
             .val = 'r',
         },
+        {
+            .name = "record-types",
+            .has_arg = required_argument,
+            .val = 'T',
+        },
+        {
+            .name = "shards",
+            .has_arg = required_argument,
+            .val = 'S',
+        },
+        {
+            .name = "sliding-window",
+            .val = 'w',
+        },
+        {
+            .name = "spill-dir",
+            .has_arg = required_argument,
+            .val = 'D',
+        },
+        {
+            .name = "stats",
+            .val = 's',
+        },
+        {
+            .name = "threads",
+            .has_arg = required_argument,
+            .val = 't',
+        },
+        {
+            .name = "user",
+            .has_arg = required_argument,
+            .val = 'u',
+        },
         {}
     };
     enum rbh_source_t source_type = SRC_DEFAULT;
+    const char *record_types = NULL;
+    const char *username = NULL;
+    struct timespec ttl;
+    bool print_stats = false;
+    size_t threads = 1;
+    struct deduplicator_options options = {
+        .batch_size = DEFAULT_BATCH_SIZE,
+    };
+    struct prefetch_options prefetch = {
+        .depth = 0,
+    };
     char c;
 
     /* Parse the command line */
-    while ((c = getopt_long(argc, argv, "e:hlr", LONG_OPTIONS, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "Bb:D:d:e:hlM:m:n:P:p:rS:sT:t:u:w", LONG_OPTIONS, NULL)) != -1) {
         switch (c) {
+        case 'B':
+            options.report = batch_report;
+            break;
+        case 'b':
+            options.batch_size = parse_count(optarg);
+            break;
+        case 'D':
+            options.spill_directory = optarg;
+            break;
+        case 'd':
+            options.max_delay = parse_delay(optarg);
+            break;
         case 'e':
             enrich_builder = enrich_iter_builder_from_uri(optarg);
             if (enrich_builder == NULL)
@@ -308,11 +652,47 @@ main(int argc, char *argv[])
                 error(EX_USAGE, EINVAL, "source type already specified");
             source_type = SRC_LUSTRE;
             break;
+        case 'M':
+            options.max_memory = parse_size(optarg);
+            break;
+        case 'm':
+            options.min_batch_size = parse_count(optarg);
+            break;
+        case 'n':
+            ttl = parse_delay(optarg);
+            enrich_set_negative_ttl(&ttl);
+            break;
+        case 'P':
+            parse_watermarks(optarg, &prefetch);
+            break;
+        case 'p':
+            prefetch.depth = parse_count_or_zero(optarg);
+            break;
         case 'r':
             /* Ignore errors on close */
             mount_fd_exit();
             mount_fd = -1;
             break;
+        case 'S':
+            options.shards = parse_count(optarg);
+            break;
+        case 's':
+            print_stats = true;
+            break;
+        case 'T':
+            record_types = optarg;
+            break;
+        case 't':
+            threads = parse_count(optarg);
+            if (threads > UINT_MAX)
+                error(EX_USAGE, ERANGE, "invalid count: %s", optarg);
+            break;
+        case 'u':
+            username = optarg;
+            break;
+        case 'w':
+            options.sliding = true;
+            break;
         case '?':
         default:
             /* getopt_long() prints meaningful error messages itself */
@@ -320,14 +700,42 @@ main(int argc, char *argv[])
         }
     }
 
+    if (options.min_batch_size > options.batch_size)
+        error(EX_USAGE, EINVAL,
+              "--min-batch-size cannot be greater than --batch-size");
+
+    if (options.spill_directory && options.shards > 1)
+        error(EX_USAGE, EINVAL, "--spill-dir cannot be used with --shards");
+
+    if (options.sliding) {
+        if (options.max_delay.tv_sec == 0 && options.max_delay.tv_nsec == 0)
+            error(EX_USAGE, EINVAL, "--sliding-window requires --max-delay");
+        if (options.shards > 1 || options.spill_directory)
+            error(EX_USAGE, EINVAL,
+                  "--sliding-window cannot be used with --shards nor --spill-dir");
+    }
+
+    if (prefetch.high == 0) {
+        prefetch.high = prefetch.depth;
+        prefetch.low = prefetch.depth / 2;
+    } else if (prefetch.high > prefetch.depth) {
+        error(EX_USAGE, EINVAL,
+              "--prefetch-watermarks cannot be greater than --prefetch");
+    }
+
     if (argc - optind < 2)
         error(EX_USAGE, 0, "not enough arguments");
     if (argc - optind > 2)
         error(EX_USAGE, 0, "too many arguments");
 
-    source = source_new(argv[optind++], source_type);
+    source = source_new(argv[optind++], source_type, username, record_types,
+                        &prefetch);
     sink = sink_new(argv[optind++]);
 
-    feed(sink, source, enrich_builder, strcmp(sink->name, "backend"));
+    feed(sink, source, enrich_builder, strcmp(sink->name, "backend"),
+         &options, threads);
+
+    if (print_stats)
+        stats_print();
     return error_message_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,145 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+struct region {
+    struct rbh_sstack *values;
+    /* Latest position with memory in the region */
+    uint64_t position;
+    struct region *next;
+};
+
+struct arena {
+    size_t chunk_size;
+    /* Set once a region was released, so that the next allocations go to a
+     * new region, which the next release can then reclaim in turn.
+     */
+    atomic_bool rotate;
+
+    /* Protects the list of regions, but not the newest region, which only
+     * the allocating thread ever touches.
+     */
+    pthread_mutex_t lock;
+    struct region *oldest;
+    struct region *newest;
+};
+
+static struct region *
+region_new(size_t chunk_size, uint64_t position)
+{
+    struct region *region;
+
+    region = malloc(sizeof(*region));
+    if (region == NULL)
+        return NULL;
+
+    region->values = rbh_sstack_new(chunk_size);
+    if (region->values == NULL) {
+        free(region);
+        return NULL;
+    }
+
+    region->position = position;
+    region->next = NULL;
+    return region;
+}
+
+static void
+region_destroy(struct region *region)
+{
+    rbh_sstack_destroy(region->values);
+    free(region);
+}
+
+struct arena *
+arena_new(size_t chunk_size)
+{
+    struct arena *arena;
+
+    arena = malloc(sizeof(*arena));
+    if (arena == NULL)
+        return NULL;
+
+    arena->oldest = arena->newest = region_new(chunk_size, 0);
+    if (arena->newest == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    arena->chunk_size = chunk_size;
+    atomic_init(&arena->rotate, false);
+    pthread_mutex_init(&arena->lock, NULL);
+    return arena;
+}
+
+struct rbh_sstack *
+arena_values(struct arena *arena, uint64_t position)
+{
+    struct region *newest = arena->newest;
+
+    if (atomic_load_explicit(&arena->rotate, memory_order_relaxed)) {
+        struct region *region = region_new(arena->chunk_size, position);
+
+        /* Keep using the newest region if a new one cannot be allocated */
+        if (region != NULL) {
+            atomic_store_explicit(&arena->rotate, false, memory_order_relaxed);
+
+            pthread_mutex_lock(&arena->lock);
+            newest->next = region;
+            arena->newest = region;
+            pthread_mutex_unlock(&arena->lock);
+            newest = region;
+        }
+    }
+
+    newest->position = position;
+    return newest->values;
+}
+
+void
+arena_release(struct arena *arena, uint64_t position)
+{
+    struct region *released = NULL;
+    struct region **tail = &released;
+
+    pthread_mutex_lock(&arena->lock);
+    while (arena->oldest != arena->newest
+        && arena->oldest->position <= position) {
+        *tail = arena->oldest;
+        tail = &arena->oldest->next;
+        arena->oldest = arena->oldest->next;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    *tail = NULL;
+
+    atomic_store_explicit(&arena->rotate, true, memory_order_relaxed);
+
+    while (released) {
+        struct region *next = released->next;
+
+        region_destroy(released);
+        released = next;
+    }
+}
+
+void
+arena_destroy(struct arena *arena)
+{
+    while (arena->oldest) {
+        struct region *next = arena->oldest->next;
+
+        region_destroy(arena->oldest);
+        arena->oldest = next;
+    }
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
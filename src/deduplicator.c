@@ -5,34 +5,2282 @@
 #endif
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <robinhood/itertools.h>
-#include <robinhood/ring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <miniyaml.h>
+#include <robinhood/sstack.h>
 
 #include "deduplicator.h"
+#include "ring.h"
+#include "serialization.h"
+#include "utils.h"
+
+/*----------------------------------------------------------------------------*
+ |                                   batch                                    |
+ *----------------------------------------------------------------------------*/
+
+struct fsevent_node {
+    struct rbh_fsevent fsevent;
+    struct fsevent_node *next;
+};
+
+/* Every fsevent of a batch that targets the same id is stored in the same
+ * id_entry, in the order they were received. Entries themselves are linked
+ * in the order their id was first seen.
+ */
+struct id_entry {
+    const struct rbh_id *id;
+    struct fsevent_node *first;
+    struct fsevent_node *last;
+    /* Whether the entry was created in the batch */
+    bool created;
+    /* Updates of the timestamps of the entry, folded into a single upsert
+     * which is emitted after every other fsevent of the batch.
+     */
+    struct fsevent_node *acmtime;
+    /* Value of the clock of the table when the entry was last updated */
+    size_t touched;
+    /* When the entry is due, in a sliding window */
+    int64_t deadline;
+    /* Checkpoint of the source right before the first fsevent of the entry,
+     * in a sliding window
+     */
+    uint64_t checkpoint;
+    /* Bytes of the batch the entry uses, in a sliding window */
+    size_t size;
+    struct id_entry *next;
+};
+
+struct batch {
+    struct rbh_iterator iterator;
+
+    /* Every fsevent in the batch is deep copied on this stack, which lives
+     * exactly as long as the batch.
+     */
+    struct rbh_sstack *values;
+    /* Whether fsevents added to the batch were already copied somewhere that
+     * lives as long as the batch, in which case they are not copied again.
+     */
+    bool borrowed;
+    struct id_entry *ids;
+    struct id_entry **tail;
+    /* Footprint of the fsevents the batch retains, in bytes */
+    size_t size;
+    /* Batches whose entries were appended to this one, they are destroyed
+     * along with it.
+     */
+    struct batch *merged;
+
+    struct id_entry *entry;
+    struct fsevent_node *node;
+    /* Whether the iterator reached the folded timestamp updates */
+    bool acmtime;
+};
+
+static const void *
+batch_iter_next(void *iterator)
+{
+    struct batch *batch = iterator;
+    const struct rbh_fsevent *fsevent;
+
+    while (batch->node == NULL) {
+        if (batch->entry == NULL) {
+            if (batch->acmtime) {
+                errno = ENODATA;
+                return NULL;
+            }
+
+            batch->acmtime = true;
+            batch->entry = batch->ids;
+            continue;
+        }
+
+        if (batch->acmtime)
+            batch->node = batch->entry->acmtime;
+        else
+            batch->node = batch->entry->first;
+        batch->entry = batch->entry->next;
+    }
+
+    fsevent = &batch->node->fsevent;
+    batch->node = batch->node->next;
+    return fsevent;
+}
+
+static void
+batch_iter_destroy(void *iterator)
+{
+    struct batch *batch = iterator;
+
+    while (batch) {
+        struct batch *merged = batch->merged;
+
+        rbh_sstack_destroy(batch->values);
+        free(batch);
+        batch = merged;
+    }
+}
+
+static const struct rbh_iterator_operations BATCH_ITER_OPS = {
+    .next = batch_iter_next,
+    .destroy = batch_iter_destroy,
+};
+
+static const struct rbh_iterator BATCH_ITERATOR = {
+    .ops = &BATCH_ITER_OPS,
+};
+
+static struct batch *
+batch_new(void)
+{
+    struct batch *batch;
+
+    batch = malloc(sizeof(*batch));
+    if (batch == NULL)
+        return NULL;
+
+    batch->values = rbh_sstack_new(FSEVENT_COPY_CHUNK_SIZE);
+    if (batch->values == NULL) {
+        int save_errno = errno;
+
+        free(batch);
+        errno = save_errno;
+        return NULL;
+    }
+
+    batch->iterator = BATCH_ITERATOR;
+    batch->borrowed = false;
+    batch->ids = NULL;
+    batch->tail = &batch->ids;
+    batch->size = 0;
+    batch->merged = NULL;
+    batch->entry = NULL;
+    batch->node = NULL;
+    batch->acmtime = false;
+    return batch;
+}
+
+static struct fsevent_node *
+batch_copy(struct batch *batch, struct id_entry *entry,
+           const struct rbh_fsevent *fsevent)
+{
+    struct fsevent_node *node;
+
+    node = rbh_sstack_push(batch->values, NULL, sizeof(*node));
+    if (node == NULL)
+        return NULL;
+
+    if (batch->borrowed) {
+        node->fsevent = *fsevent;
+        batch->size += sizeof(*node);
+    } else {
+        if (fsevent_copy(&node->fsevent, fsevent, batch->values))
+            return NULL;
+        batch->size += sizeof(*node) + fsevent_size(fsevent);
+    }
+    /* Share the copy of the id between every fsevent of the entry */
+    node->fsevent.id = *entry->id;
+    node->next = NULL;
+
+    return node;
+}
+
+/* Append the entries of \p other to \p batch, \p batch takes ownership of
+ * \p other.
+ */
+static void
+batch_absorb(struct batch *batch, struct batch *other)
+{
+    if (other->ids) {
+        *batch->tail = other->ids;
+        batch->tail = other->tail;
+    }
+    batch->size += other->size;
+
+    other->merged = batch->merged;
+    batch->merged = other;
+}
+
+static void
+entry_append(struct id_entry *entry, struct fsevent_node *node)
+{
+    if (entry->last)
+        entry->last->next = node;
+    else
+        entry->first = node;
+    entry->last = node;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                   merge                                    |
+ *----------------------------------------------------------------------------*/
+
+static bool
+value_equal(const struct rbh_value *first, const struct rbh_value *second);
+
+static const struct rbh_value_pair *
+value_map_find(const struct rbh_value_map *map, const char *key)
+{
+    for (size_t i = 0; i < map->count; i++) {
+        if (strcmp(map->pairs[i].key, key) == 0)
+            return &map->pairs[i];
+    }
+    return NULL;
+}
+
+static bool
+value_map_equal(const struct rbh_value_map *first,
+                const struct rbh_value_map *second)
+{
+    if (first->count != second->count)
+        return false;
+
+    for (size_t i = 0; i < first->count; i++) {
+        const struct rbh_value_pair *pair;
+
+        pair = value_map_find(second, first->pairs[i].key);
+        if (pair == NULL || !value_equal(first->pairs[i].value, pair->value))
+            return false;
+    }
+    return true;
+}
+
+static bool
+value_equal(const struct rbh_value *first, const struct rbh_value *second)
+{
+    if (first == NULL || second == NULL)
+        return first == second;
+
+    if (first->type != second->type)
+        return false;
+
+    switch (first->type) {
+    case RBH_VT_BOOLEAN:
+        return first->boolean == second->boolean;
+    case RBH_VT_INT32:
+        return first->int32 == second->int32;
+    case RBH_VT_UINT32:
+        return first->uint32 == second->uint32;
+    case RBH_VT_INT64:
+        return first->int64 == second->int64;
+    case RBH_VT_UINT64:
+        return first->uint64 == second->uint64;
+    case RBH_VT_STRING:
+        return strcmp(first->string, second->string) == 0;
+    case RBH_VT_BINARY:
+        return first->binary.size == second->binary.size
+            && memcmp(first->binary.data, second->binary.data,
+                      first->binary.size) == 0;
+    case RBH_VT_REGEX:
+        return first->regex.options == second->regex.options
+            && strcmp(first->regex.string, second->regex.string) == 0;
+    case RBH_VT_SEQUENCE:
+        if (first->sequence.count != second->sequence.count)
+            return false;
+        for (size_t i = 0; i < first->sequence.count; i++) {
+            if (!value_equal(&first->sequence.values[i],
+                             &second->sequence.values[i]))
+                return false;
+        }
+        return true;
+    case RBH_VT_MAP:
+        return value_map_equal(&first->map, &second->map);
+    }
+    return false;
+}
+
+static bool
+is_partial_key(const char *key)
+{
+    return strcmp(key, "rbh-fsevents") == 0;
+}
+
+static bool
+value_has_type(const struct rbh_value *value, enum rbh_value_type type)
+{
+    return value != NULL && value->type == type;
+}
+
+/* Whether two requests for the same partial field can be merged: statx masks
+ * and lists of xattrs are merged together, other fields must be identical.
+ */
+static bool
+partial_compatible(const struct rbh_value_pair *first,
+                   const struct rbh_value_pair *second)
+{
+    if (strcmp(first->key, "statx") == 0)
+        return value_has_type(first->value, RBH_VT_UINT32)
+            && value_has_type(second->value, RBH_VT_UINT32);
+
+    if (strcmp(first->key, "xattrs") == 0)
+        return value_has_type(first->value, RBH_VT_SEQUENCE)
+            && value_has_type(second->value, RBH_VT_SEQUENCE);
+
+    return value_equal(first->value, second->value);
+}
+
+static bool
+partials_compatible(const struct rbh_value *first,
+                    const struct rbh_value *second)
+{
+    if (first == NULL || second == NULL)
+        return first == second;
+
+    if (first->type != RBH_VT_MAP || second->type != RBH_VT_MAP)
+        return false;
+
+    for (size_t i = 0; i < first->map.count; i++) {
+        const struct rbh_value_pair *partial = &first->map.pairs[i];
+        const struct rbh_value_pair *other;
+
+        other = value_map_find(&second->map, partial->key);
+        if (other && !partial_compatible(partial, other))
+            return false;
+    }
+    return true;
+}
+
+static int
+pair_copy(struct rbh_value_pair *dest, const struct rbh_value_pair *src,
+          struct rbh_sstack *values)
+{
+    const struct rbh_value_map map = {
+        .pairs = src,
+        .count = 1,
+    };
+    struct rbh_value_map copy;
+
+    if (value_map_copy(&copy, &map, values))
+        return -1;
+
+    *dest = copy.pairs[0];
+    return 0;
+}
+
+/* The union of two lists of xattrs to enrich */
+static struct rbh_value *
+xattrs_union(const struct rbh_value *first, const struct rbh_value *second,
+             struct rbh_sstack *values)
+{
+    const struct rbh_value_pair pair = {
+        .key = "xattrs",
+        .value = second,
+    };
+    struct rbh_value_pair copy;
+    struct rbh_value *sequence;
+    struct rbh_value *names;
+    size_t count;
+
+    /* \p second may not live on \p values */
+    if (pair_copy(&copy, &pair, values))
+        return NULL;
+    second = copy.value;
+
+    sequence = rbh_sstack_push(values, NULL, sizeof(*sequence));
+    if (sequence == NULL)
+        return NULL;
+
+    names = rbh_sstack_push(values, NULL, (first->sequence.count
+                                           + second->sequence.count)
+                                        * sizeof(*names));
+    if (names == NULL)
+        return NULL;
+
+    count = first->sequence.count;
+    memcpy(names, first->sequence.values, count * sizeof(*names));
+
+    for (size_t i = 0; i < second->sequence.count; i++) {
+        const struct rbh_value *name = &second->sequence.values[i];
+        bool found = false;
+
+        for (size_t j = 0; j < first->sequence.count && !found; j++)
+            found = value_equal(name, &first->sequence.values[j]);
+
+        if (!found)
+            names[count++] = *name;
+    }
+
+    sequence->type = RBH_VT_SEQUENCE;
+    sequence->sequence.values = names;
+    sequence->sequence.count = count;
+    return sequence;
+}
+
+static struct rbh_value *
+partials_merge(const struct rbh_value *first, const struct rbh_value *second,
+               struct rbh_sstack *values)
+{
+    struct rbh_value_pair *pairs;
+    struct rbh_value *merged;
+    size_t count = 0;
+
+    merged = rbh_sstack_push(values, NULL, sizeof(*merged));
+    if (merged == NULL)
+        return NULL;
+
+    pairs = rbh_sstack_push(values, NULL, (first->map.count
+                                           + second->map.count)
+                                        * sizeof(*pairs));
+    if (pairs == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < first->map.count; i++) {
+        const struct rbh_value_pair *partial = &first->map.pairs[i];
+        const struct rbh_value_pair *other;
+        struct rbh_value *mask;
+
+        other = value_map_find(&second->map, partial->key);
+        if (other && strcmp(partial->key, "xattrs") == 0) {
+            pairs[count].key = partial->key;
+            pairs[count].value = xattrs_union(partial->value, other->value,
+                                              values);
+            if (pairs[count++].value == NULL)
+                return NULL;
+            continue;
+        }
+
+        if (other == NULL || strcmp(partial->key, "statx")) {
+            pairs[count++] = *partial;
+            continue;
+        }
+
+        /* Enrich the union of both statx masks */
+        mask = rbh_sstack_push(values, NULL, sizeof(*mask));
+        if (mask == NULL)
+            return NULL;
+        mask->type = RBH_VT_UINT32;
+        mask->uint32 = partial->value->uint32 | other->value->uint32;
+
+        pairs[count].key = partial->key;
+        pairs[count++].value = mask;
+    }
+
+    for (size_t i = 0; i < second->map.count; i++) {
+        const struct rbh_value_pair *partial = &second->map.pairs[i];
+
+        if (value_map_find(&first->map, partial->key))
+            continue;
+
+        if (pair_copy(&pairs[count++], partial, values))
+            return NULL;
+    }
+
+    merged->type = RBH_VT_MAP;
+    merged->map.pairs = pairs;
+    merged->map.count = count;
+    return merged;
+}
+
+static bool
+xattrs_compatible(const struct rbh_value_map *first,
+                  const struct rbh_value_map *second)
+{
+    const struct rbh_value_pair *partials;
+    const struct rbh_value_pair *other;
+
+    partials = value_map_find(first, "rbh-fsevents");
+    other = value_map_find(second, "rbh-fsevents");
+    if (partials == NULL || other == NULL)
+        return true;
+
+    return partials_compatible(partials->value, other->value);
+}
+
+/* Merge \p newer into \p older: xattrs set by \p newer override those of
+ * \p older, except for partial fields which are merged together.
+ */
+static int
+xattrs_merge(struct rbh_value_map *older, const struct rbh_value_map *newer,
+             struct rbh_sstack *values)
+{
+    struct rbh_value_pair *pairs;
+    size_t count = 0;
+
+    if (newer->count == 0)
+        return 0;
+
+    pairs = rbh_sstack_push(values, NULL,
+                            (older->count + newer->count) * sizeof(*pairs));
+    if (pairs == NULL)
+        return -1;
+
+    for (size_t i = 0; i < older->count; i++) {
+        const struct rbh_value_pair *pair = &older->pairs[i];
+        const struct rbh_value_pair *override;
+
+        override = value_map_find(newer, pair->key);
+        if (override == NULL) {
+            pairs[count++] = *pair;
+            continue;
+        }
+
+        if (is_partial_key(pair->key) && pair->value && override->value) {
+            pairs[count].key = pair->key;
+            pairs[count].value = partials_merge(pair->value, override->value,
+                                                values);
+            if (pairs[count++].value == NULL)
+                return -1;
+            continue;
+        }
+
+        if (pair_copy(&pairs[count++], override, values))
+            return -1;
+    }
+
+    for (size_t i = 0; i < newer->count; i++) {
+        const struct rbh_value_pair *pair = &newer->pairs[i];
+
+        if (value_map_find(older, pair->key))
+            continue;
+
+        if (pair_copy(&pairs[count++], pair, values))
+            return -1;
+    }
+
+    older->pairs = pairs;
+    older->count = count;
+    return 0;
+}
+
+/* Merge two upserts of the same id into a single upsert: the union of their
+ * statx fields, with the values of \p newer.
+ */
+static int
+upsert_merge(struct rbh_fsevent *older, const struct rbh_fsevent *newer,
+             struct rbh_sstack *values)
+{
+    if (!xattrs_compatible(&older->xattrs, &newer->xattrs))
+        return 0;
+
+    if (xattrs_merge(&older->xattrs, &newer->xattrs, values))
+        return -1;
+
+    if (newer->upsert.statx) {
+        struct rbh_statx *statxbuf;
+
+        statxbuf = rbh_sstack_push(values, NULL, sizeof(*statxbuf));
+        if (statxbuf == NULL)
+            return -1;
+
+        if (older->upsert.statx) {
+            *statxbuf = *older->upsert.statx;
+            merge_statx(statxbuf, newer->upsert.statx);
+        } else {
+            *statxbuf = *newer->upsert.statx;
+        }
+        older->upsert.statx = statxbuf;
+    }
+
+    if (newer->upsert.symlink) {
+        older->upsert.symlink = rbh_sstack_push(values, newer->upsert.symlink,
+                                                strlen(newer->upsert.symlink)
+                                                + 1);
+        if (older->upsert.symlink == NULL)
+            return -1;
+    }
+
+    return 1;
+}
+
+/* Composition table of the fsevents of a single id
+ *
+ * A newer fsevent is merged into the latest older fsevent of the same kind
+ * (upserts, inode xattrs, or namespace xattrs of the same entry) provided
+ * every fsevent in between commutes with it. A delete supersedes every
+ * fsevent before it, and if the entry was created in the same batch, the
+ * delete itself is dropped. An unlink cancels the latest link of the same
+ * namespace entry, links are never merged.
+ *
+ * Partial fields requested by several inode fsevents are only requested by
+ * the earliest of them, fsevents left with nothing to update are dropped.
+ */
+
+static bool
+is_inode_fsevent(const struct rbh_fsevent *fsevent)
+{
+    switch (fsevent->type) {
+    case RBH_FET_UPSERT:
+        return true;
+    case RBH_FET_XATTR:
+        return fsevent->ns.parent_id == NULL;
+    default:
+        return false;
+    }
+}
+
+static bool
+is_namespace_fsevent(const struct rbh_fsevent *fsevent)
+{
+    switch (fsevent->type) {
+    case RBH_FET_LINK:
+    case RBH_FET_UNLINK:
+        return true;
+    case RBH_FET_XATTR:
+        return fsevent->ns.parent_id != NULL;
+    default:
+        return false;
+    }
+}
+
+/* Links, unlinks and namespace xattrs all store their entry in the same
+ * fields.
+ */
+static bool
+same_namespace_entry(const struct rbh_fsevent *first,
+                     const struct rbh_fsevent *second)
+{
+    return first->link.parent_id->size == second->link.parent_id->size
+        && memcmp(first->link.parent_id->data, second->link.parent_id->data,
+                  first->link.parent_id->size) == 0
+        && strcmp(first->link.name, second->link.name) == 0;
+}
+
+/* Partial fields are resolved from the current state of the filesystem when
+ * fsevents are enriched, they never conflict with one another.
+ */
+static bool
+xattrs_disjoint(const struct rbh_value_map *first,
+                const struct rbh_value_map *second)
+{
+    for (size_t i = 0; i < first->count; i++) {
+        const char *key = first->pairs[i].key;
+
+        if (!is_partial_key(key) && value_map_find(second, key))
+            return false;
+    }
+    return true;
+}
+
+/* Whether applying \p older and \p newer in either order yields the same
+ * result
+ */
+static bool
+fsevents_commute(const struct rbh_fsevent *older,
+                 const struct rbh_fsevent *newer)
+{
+    if (older->type == RBH_FET_DELETE || newer->type == RBH_FET_DELETE)
+        return false;
+
+    if (is_namespace_fsevent(older) && is_namespace_fsevent(newer))
+        return !same_namespace_entry(older, newer);
+
+    if (is_inode_fsevent(older) && is_inode_fsevent(newer))
+        return older->type != newer->type
+            && xattrs_disjoint(&older->xattrs, &newer->xattrs);
+
+    /* One updates the inode, the other one a namespace entry */
+    return true;
+}
+
+static bool
+fsevents_mergeable(const struct rbh_fsevent *older,
+                   const struct rbh_fsevent *newer)
+{
+    if (older->type != newer->type)
+        return false;
+
+    switch (older->type) {
+    case RBH_FET_UPSERT:
+        return true;
+    case RBH_FET_XATTR:
+        if (older->ns.parent_id == NULL || newer->ns.parent_id == NULL)
+            return older->ns.parent_id == newer->ns.parent_id;
+        return same_namespace_entry(older, newer);
+    default:
+        return false;
+    }
+}
+
+/* Returns 1 if \p newer was merged into \p older, 0 if it could not be, and
+ * -1 on error.
+ */
+static int
+fsevent_merge(struct rbh_fsevent *older, const struct rbh_fsevent *newer,
+              struct rbh_sstack *values)
+{
+    switch (newer->type) {
+    case RBH_FET_UPSERT:
+        return upsert_merge(older, newer, values);
+    case RBH_FET_XATTR:
+        /* Last writer wins */
+        if (!xattrs_compatible(&older->xattrs, &newer->xattrs))
+            return 0;
+        return xattrs_merge(&older->xattrs, &newer->xattrs, values) ? -1 : 1;
+    default:
+        return 0;
+    }
+}
+
+/* Whether \p fsevent does not update anything anymore */
+static bool
+fsevent_is_empty(const struct rbh_fsevent *fsevent)
+{
+    switch (fsevent->type) {
+    case RBH_FET_UPSERT:
+        return fsevent->xattrs.count == 0 && fsevent->upsert.statx == NULL
+            && fsevent->upsert.symlink == NULL;
+    case RBH_FET_XATTR:
+        return fsevent->xattrs.count == 0;
+    default:
+        return false;
+    }
+}
+
+/* Move the partial fields \p newer requests that \p older also requests to
+ * \p older, so that enrichers only retrieve them once.
+ *
+ * Returns 1 if any partial field was moved, 0 if none was, and -1 on error.
+ */
+static int
+partials_hoist(struct rbh_fsevent *older, struct rbh_fsevent *newer,
+               struct rbh_sstack *values)
+{
+    const struct rbh_value_pair *theirs;
+    const struct rbh_value_pair *ours;
+    struct rbh_value_pair *remaining;
+    struct rbh_value_pair *hoisted;
+    struct rbh_value_pair *xattrs;
+    struct rbh_value_map request;
+    struct rbh_value partials;
+    struct rbh_value_pair pair;
+    size_t remaining_count = 0;
+    size_t hoisted_count = 0;
+    size_t count = 0;
+
+    theirs = value_map_find(&older->xattrs, "rbh-fsevents");
+    ours = value_map_find(&newer->xattrs, "rbh-fsevents");
+    if (theirs == NULL || ours == NULL
+     || !value_has_type(theirs->value, RBH_VT_MAP)
+     || !value_has_type(ours->value, RBH_VT_MAP))
+        return 0;
+
+    hoisted = rbh_sstack_push(values, NULL,
+                              2 * ours->value->map.count * sizeof(*hoisted));
+    if (hoisted == NULL)
+        return -1;
+    remaining = hoisted + ours->value->map.count;
+
+    for (size_t i = 0; i < ours->value->map.count; i++) {
+        const struct rbh_value_pair *partial = &ours->value->map.pairs[i];
+        const struct rbh_value_pair *other;
+
+        other = value_map_find(&theirs->value->map, partial->key);
+        if (other && partial_compatible(other, partial))
+            hoisted[hoisted_count++] = *partial;
+        else
+            remaining[remaining_count++] = *partial;
+    }
+
+    if (hoisted_count == 0)
+        return 0;
+
+    partials.type = RBH_VT_MAP;
+    partials.map.pairs = hoisted;
+    partials.map.count = hoisted_count;
+    pair.key = "rbh-fsevents";
+    pair.value = &partials;
+    request.pairs = &pair;
+    request.count = 1;
+    if (xattrs_merge(&older->xattrs, &request, values))
+        return -1;
+
+    xattrs = rbh_sstack_push(values, NULL,
+                             newer->xattrs.count * sizeof(*xattrs));
+    if (xattrs == NULL)
+        return -1;
+
+    for (size_t i = 0; i < newer->xattrs.count; i++) {
+        const struct rbh_value_pair *xattr = &newer->xattrs.pairs[i];
+        struct rbh_value *value;
+
+        if (!is_partial_key(xattr->key)) {
+            xattrs[count++] = *xattr;
+            continue;
+        }
+
+        if (remaining_count == 0)
+            continue;
+
+        value = rbh_sstack_push(values, NULL, sizeof(*value));
+        if (value == NULL)
+            return -1;
+        value->type = RBH_VT_MAP;
+        value->map.pairs = remaining;
+        value->map.count = remaining_count;
+
+        xattrs[count].key = xattr->key;
+        xattrs[count++].value = value;
+    }
+
+    newer->xattrs.pairs = xattrs;
+    newer->xattrs.count = count;
+    return 1;
+}
+
+/* Memory on the stack is never reclaimed, only account growth */
+static void
+batch_grow(struct batch *batch, const struct fsevent_node *node, size_t size)
+{
+    if (fsevent_size(&node->fsevent) > size)
+        batch->size += fsevent_size(&node->fsevent) - size;
+}
+
+/* Merge \p fsevent into \p node, accounting for the memory this requires
+ *
+ * Returns 1 if \p fsevent was merged into \p node, 0 if it could not be, and
+ * -1 on error.
+ */
+static int
+batch_merge(struct batch *batch, struct fsevent_node *node,
+            const struct rbh_fsevent *fsevent)
+{
+    size_t size = fsevent_size(&node->fsevent);
+    int rc;
+
+    rc = fsevent_merge(&node->fsevent, fsevent, batch->values);
+    if (rc > 0)
+        batch_grow(batch, node, size);
+
+    return rc;
+}
+
+/* Move the partial fields \p node requests to the inode fsevents of \p entry
+ * from \p start onwards which also request them.
+ *
+ * Returns 1 if \p node has nothing left to update, 0 if it does, and -1 on
+ * error.
+ */
+static int
+batch_hoist(struct batch *batch, struct fsevent_node *start,
+            struct fsevent_node *node)
+{
+    bool hoisted = false;
+
+    for (struct fsevent_node *older = start; older; older = older->next) {
+        size_t size = fsevent_size(&older->fsevent);
+        int rc;
+
+        if (!is_inode_fsevent(&older->fsevent))
+            continue;
+
+        rc = partials_hoist(&older->fsevent, &node->fsevent, batch->values);
+        if (rc < 0)
+            return -1;
+
+        if (rc > 0) {
+            batch_grow(batch, older, size);
+            hoisted = true;
+        }
+    }
+
+    return hoisted && fsevent_is_empty(&node->fsevent);
+}
+
+/* Whether \p fsevent only requests the enrichment of some of the timestamps
+ * of its entry, as the Lustre source does for the parent of every entry that
+ * is created, linked or unlinked.
+ */
+static bool
+is_acmtime_update(const struct rbh_fsevent *fsevent)
+{
+    const uint32_t ACMTIME = RBH_STATX_ATIME | RBH_STATX_CTIME
+                           | RBH_STATX_MTIME;
+    const struct rbh_value_pair *partials;
+    const struct rbh_value_pair *mask;
+
+    if (fsevent->type != RBH_FET_UPSERT || fsevent->upsert.statx != NULL
+     || fsevent->upsert.symlink != NULL || fsevent->xattrs.count != 1)
+        return false;
+
+    partials = &fsevent->xattrs.pairs[0];
+    if (!is_partial_key(partials->key) || partials->value == NULL
+     || partials->value->type != RBH_VT_MAP
+     || partials->value->map.count != 1)
+        return false;
+
+    mask = &partials->value->map.pairs[0];
+    return strcmp(mask->key, "statx") == 0 && mask->value != NULL
+        && mask->value->type == RBH_VT_UINT32
+        && (mask->value->uint32 & ~ACMTIME) == 0;
+}
+
+/* The Lustre source sets the "fid" xattr of an inode when, and only when, it
+ * is created.
+ */
+static bool
+is_creation(const struct rbh_fsevent *fsevent)
+{
+    return fsevent->type == RBH_FET_XATTR && fsevent->ns.parent_id == NULL
+        && value_map_find(&fsevent->xattrs, "fid");
+}
+
+/*----------------------------------------------------------------------------*
+ |                                deduplicator                                |
+ *----------------------------------------------------------------------------*/
+
+static struct deduplicator_stats cumulative;
+static pthread_mutex_t cumulative_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+deduplicator_get_stats(struct deduplicator_stats *stats)
+{
+    pthread_mutex_lock(&cumulative_lock);
+    *stats = cumulative;
+    pthread_mutex_unlock(&cumulative_lock);
+}
+
+/* Add \p stats to \p sum, and reset them */
+static void
+stats_collect(struct deduplicator_stats *sum, struct deduplicator_stats *stats)
+{
+    for (size_t i = 0; i < FSEVENT_TYPE_COUNT; i++) {
+        sum->in[i] += stats->in[i];
+        sum->out[i] += stats->out[i];
+    }
+    sum->merged += stats->merged;
+    sum->hoisted += stats->hoisted;
+    sum->acmtime_folded += stats->acmtime_folded;
+    sum->links_cancelled += stats->links_cancelled;
+    sum->superseded += stats->superseded;
+    sum->temporary += stats->temporary;
+    sum->spilled += stats->spilled;
+
+    memset(stats, 0, sizeof(*stats));
+}
+
+static size_t
+node_count(const struct fsevent_node *node)
+{
+    size_t count = 0;
+
+    for (; node; node = node->next)
+        count++;
+    return count;
+}
+
+/* A link followed by an unlink of the same namespace entry cancel each other
+ * out, along with every update of the xattrs of that namespace entry in
+ * between. This collapses chains of renames to their net result.
+ *
+ * Returns whether \p unlink cancelled a link of \p entry.
+ */
+static bool
+entry_cancel_link(struct id_entry *entry, const struct rbh_fsevent *unlink)
+{
+    struct fsevent_node **link = NULL;
+    struct fsevent_node **node;
+
+    for (node = &entry->first; *node; node = &(*node)->next) {
+        const struct rbh_fsevent *fsevent = &(*node)->fsevent;
+
+        if (fsevent->type != RBH_FET_LINK && fsevent->type != RBH_FET_UNLINK)
+            continue;
+
+        if (same_namespace_entry(fsevent, unlink))
+            link = fsevent->type == RBH_FET_LINK ? node : NULL;
+    }
+
+    if (link == NULL)
+        return false;
+
+    /* Memory on the stack is never reclaimed, nothing to account */
+    *link = (*link)->next;
+    for (node = link; *node; ) {
+        const struct rbh_fsevent *fsevent = &(*node)->fsevent;
+
+        if (is_namespace_fsevent(fsevent)
+         && same_namespace_entry(fsevent, unlink))
+            *node = (*node)->next;
+        else
+            node = &(*node)->next;
+    }
+
+    entry->last = NULL;
+    for (struct fsevent_node *last = entry->first; last; last = last->next)
+        entry->last = last;
+
+    return true;
+}
+
+/* Slots keep the hash of the id of their entry, probing only looks at the
+ * entries whose hash matches.
+ */
+struct slot {
+    size_t hash;
+    struct id_entry *entry;
+};
+
+/* Open addressing hashtable of the ids of a batch */
+struct table {
+    struct slot *slots;
+    /* A power of 2 */
+    size_t size;
+    size_t count;
+    /* Incremented every time an entry is updated */
+    size_t clock;
+    /* What became of the fsevents added since the batch was last yielded */
+    struct deduplicator_stats stats;
+};
+
+/* The table holds up to \p count ids without growing */
+static int
+table_init(struct table *table, size_t count)
+{
+    size_t size = 16;
+
+    while (size < 2 * count)
+        size <<= 1;
+
+    table->slots = calloc(size, sizeof(*table->slots));
+    if (table->slots == NULL)
+        return -1;
+
+    table->size = size;
+    table->count = 0;
+    table->clock = 0;
+    memset(&table->stats, 0, sizeof(table->stats));
+    return 0;
+}
+
+static void
+table_clear(struct table *table)
+{
+    memset(table->slots, 0, table->size * sizeof(*table->slots));
+    table->count = 0;
+}
+
+static struct slot *
+table_find(struct table *table, const struct rbh_id *id, size_t hash)
+{
+    size_t mask = table->size - 1;
+    size_t i;
+
+    for (i = hash & mask; table->slots[i].entry; i = (i + 1) & mask) {
+        if (table->slots[i].hash == hash
+         && id_equal(table->slots[i].entry->id, id))
+            break;
+    }
+    return &table->slots[i];
+}
+
+/* Double the size of \p table */
+static int
+table_grow(struct table *table)
+{
+    struct slot *slots = table->slots;
+    size_t size = table->size;
+    size_t mask;
+
+    table->slots = calloc(2 * size, sizeof(*table->slots));
+    if (table->slots == NULL) {
+        table->slots = slots;
+        return -1;
+    }
+    table->size *= 2;
+    mask = table->size - 1;
+
+    /* Ids are unique, only look for a free slot */
+    for (size_t i = 0; i < size; i++) {
+        size_t j;
+
+        if (slots[i].entry == NULL)
+            continue;
+
+        for (j = slots[i].hash & mask; table->slots[j].entry;
+             j = (j + 1) & mask)
+            ;
+        table->slots[j] = slots[i];
+    }
+
+    free(slots);
+    return 0;
+}
+
+/* Backward shift deletion: move up the entries that would not be found
+ * anymore once \p slot is empty.
+ */
+static void
+table_remove(struct table *table, struct slot *slot)
+{
+    size_t mask = table->size - 1;
+    size_t hole = slot - table->slots;
+    size_t i = hole;
+
+    while (true) {
+        size_t home;
+
+        i = (i + 1) & mask;
+        if (table->slots[i].entry == NULL)
+            break;
+
+        /* Entries whose probe sequence starts between the hole and them
+         * stay where they are.
+         */
+        home = table->slots[i].hash & mask;
+        if (hole < i ? home <= hole || home > i : home <= hole && home > i) {
+            table->slots[hole] = table->slots[i];
+            hole = i;
+        }
+    }
+
+    table->slots[hole].entry = NULL;
+    table->count--;
+}
+
+static struct id_entry *
+table_get_entry(struct table *table, struct batch *batch,
+                const struct rbh_id *id)
+{
+    size_t hash = id_hash(id);
+    struct slot *slot = table_find(table, id, hash);
+    struct id_entry *entry;
+
+    if (slot->entry)
+        return slot->entry;
+
+    /* Keep the load factor under 1/2 */
+    if (2 * (table->count + 1) > table->size) {
+        if (table_grow(table))
+            return NULL;
+        slot = table_find(table, id, hash);
+    }
+
+    entry = rbh_sstack_push(batch->values, NULL, sizeof(*entry));
+    if (entry == NULL)
+        return NULL;
+
+    entry->id = id_copy(id, batch->values);
+    if (entry->id == NULL)
+        return NULL;
+
+    entry->first = NULL;
+    entry->last = NULL;
+    entry->created = false;
+    entry->acmtime = NULL;
+    entry->deadline = 0;
+    entry->checkpoint = 0;
+    entry->size = 0;
+    entry->next = NULL;
+    batch->size += sizeof(*entry) + sizeof(*entry->id) + id->size;
+
+    *batch->tail = entry;
+    batch->tail = &entry->next;
+    table->count++;
+    slot->hash = hash;
+    slot->entry = entry;
+    return entry;
+}
+
+static int
+deduplicator_add(struct table *table, struct batch *batch,
+                 const struct rbh_fsevent *fsevent)
+{
+    struct fsevent_node *target = NULL;
+    struct fsevent_node *start;
+    struct fsevent_node *node;
+    struct id_entry *entry;
+
+    entry = table_get_entry(table, batch, &fsevent->id);
+    if (entry == NULL)
+        return -1;
+    entry->touched = table->clock++;
+
+    if (fsevent->type == RBH_FET_DELETE) {
+        table->stats.superseded += node_count(entry->first)
+                                 + node_count(entry->acmtime);
+
+        /* Memory on the stack is never reclaimed, nothing to account */
+        entry->first = NULL;
+        entry->last = NULL;
+        entry->acmtime = NULL;
+
+        /* The backend never has to know about temporary entries */
+        if (entry->created) {
+            table->stats.temporary++;
+            return 0;
+        }
+    }
+
+    if (is_acmtime_update(fsevent)) {
+        if (entry->acmtime == NULL) {
+            entry->acmtime = batch_copy(batch, entry, fsevent);
+            return entry->acmtime == NULL ? -1 : 0;
+        }
+
+        switch (batch_merge(batch, entry->acmtime, fsevent)) {
+        case -1:
+            return -1;
+        case 1:
+            table->stats.acmtime_folded++;
+            return 0;
+        }
+    }
+
+    if (fsevent->type == RBH_FET_UNLINK && entry_cancel_link(entry, fsevent)) {
+        table->stats.links_cancelled++;
+        return 0;
+    }
+
+    if (is_creation(fsevent))
+        entry->created = true;
+
+    /* Only the fsevents after the last one that does not commute with
+     * fsevent may absorb it, or part of it.
+     */
+    start = entry->first;
+    for (node = entry->first; node; node = node->next) {
+        if (fsevents_mergeable(&node->fsevent, fsevent)) {
+            target = node;
+        } else if (!fsevents_commute(&node->fsevent, fsevent)) {
+            target = NULL;
+            start = node->next;
+        }
+    }
+
+    if (target) {
+        int rc = batch_merge(batch, target, fsevent);
+
+        if (rc > 0)
+            table->stats.merged++;
+        if (rc)
+            return rc < 0 ? -1 : 0;
+    }
+
+    node = batch_copy(batch, entry, fsevent);
+    if (node == NULL)
+        return -1;
+
+    if (is_inode_fsevent(fsevent)) {
+        switch (batch_hoist(batch, start, node)) {
+        case -1:
+            return -1;
+        case 1:
+            table->stats.hoisted++;
+            return 0;
+        }
+    }
+
+    entry_append(entry, node);
+    return 0;
+}
+
+struct deduplicator {
+    struct rbh_mut_iterator batches;
+
+    struct source *source;
+    struct deduplicator_options options;
+
+    /* The ids of the batch being built, when it is not sharded */
+    struct table table;
+    /* NULL unless batches may overflow to disk */
+    struct spill *spill;
+    /* NULL unless ids are held in a sliding window */
+    struct window *window;
+    /* Whether batches point to what the fsevents of the source point to,
+     * rather than copy it, see source->retains.
+     */
+    bool borrowed;
+
+    /* Fsevents read since the last batch was yielded, the tables count the
+     * rest.
+     */
+    struct deduplicator_stats stats;
+
+    struct shard *shards;
+    size_t shard_count;
+};
+
+static int64_t
+timespec2ns(const struct timespec *timespec)
+{
+    return timespec->tv_sec * INT64_C(1000000000) + timespec->tv_nsec;
+}
 
-struct deduplicator {
-    struct rbh_mut_iterator batches;
+/* Whether the batch of \p count fsevents that started at \p start must be
+ * flushed to honour the maximum delay.
+ */
+static bool
+deduplicator_is_late(struct deduplicator *deduplicator, int64_t start,
+                     size_t count)
+{
+    int64_t max_delay = timespec2ns(&deduplicator->options.max_delay);
+    struct timespec now;
 
-    struct source *source;
+    if (max_delay == 0)
+        return false;
+
+    /* Catching up: the source still has fsevents to yield */
+    if (count < deduplicator->options.min_batch_size)
+        return false;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return timespec2ns(&now) - start >= max_delay;
+}
+
+/* Unexpected types of fsevents are not counted */
+static void
+count_type(size_t counts[FSEVENT_TYPE_COUNT], enum rbh_fsevent_type type)
+{
+    if ((unsigned int)type < FSEVENT_TYPE_COUNT)
+        counts[type]++;
+}
+
+static void
+deduplicator_count(struct deduplicator *deduplicator,
+                   const struct rbh_fsevent *fsevent)
+{
+    count_type(deduplicator->stats.in, fsevent->type);
+}
+
+static void
+deduplicator_account(struct deduplicator *deduplicator,
+                     const struct batch *batch);
+
+/*----------------------------------------------------------------------------*
+ |                                   spill                                    |
+ *----------------------------------------------------------------------------*/
+
+/* When a batch uses max_memory bytes and a spill directory is configured, the
+ * entries of the batch that were not updated recently are serialized in a
+ * temporary file and the batch goes on, until it holds batch_size fsevents or
+ * it is late. Once the batch is cut, the spill file is mapped in memory and
+ * its fsevents are deduplicated again, before those that stayed in memory:
+ * the fsevents of an id in the file are older than those still in memory.
+ *
+ * Memory on the stack of a batch is never reclaimed, the entries that stay in
+ * memory are copied in a new batch instead.
+ */
+
+struct spill {
+    FILE *file;
+    yaml_emitter_t emitter;
+    /* Number of fsevents in the file */
+    size_t count;
+    /* Value of the clock of the table when entries were last spilled */
+    size_t clock;
 };
 
+static int
+spill_start(struct spill *spill)
+{
+    if (!yaml_emitter_initialize(&spill->emitter)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    yaml_emitter_set_output_file(&spill->emitter, spill->file);
+    yaml_emitter_set_unicode(&spill->emitter, true);
+
+    if (!yaml_emit_stream_start(&spill->emitter, YAML_UTF8_ENCODING)) {
+        yaml_emitter_delete(&spill->emitter);
+        return -1;
+    }
+    return 0;
+}
+
+static struct spill *
+spill_new(const char *directory)
+{
+    struct spill *spill;
+    int save_errno;
+    int fd;
+
+    spill = malloc(sizeof(*spill));
+    if (spill == NULL)
+        return NULL;
+
+    /* The file is never linked in the namespace, it goes away with us */
+    fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        goto out_free_spill;
+
+    spill->file = fdopen(fd, "w+");
+    if (spill->file == NULL) {
+        save_errno = errno;
+        close(fd);
+        errno = save_errno;
+        goto out_free_spill;
+    }
+
+    if (spill_start(spill))
+        goto out_fclose;
+
+    spill->count = 0;
+    spill->clock = 0;
+    return spill;
+
+out_fclose:
+    save_errno = errno;
+    fclose(spill->file);
+    errno = save_errno;
+out_free_spill:
+    save_errno = errno;
+    free(spill);
+    errno = save_errno;
+    return NULL;
+}
+
+static void
+spill_destroy(struct spill *spill)
+{
+    yaml_emitter_delete(&spill->emitter);
+    /* Ignore errors on close */
+    fclose(spill->file);
+    free(spill);
+}
+
+/* Empty the spill file for the next batch */
+static int
+spill_reset(struct spill *spill)
+{
+    yaml_emitter_delete(&spill->emitter);
+    rewind(spill->file);
+    if (ftruncate(fileno(spill->file), 0))
+        return -1;
+
+    spill->count = 0;
+    spill->clock = 0;
+    return spill_start(spill);
+}
+
+static int
+spill_entry(struct spill *spill, const struct id_entry *entry)
+{
+    for (struct fsevent_node *node = entry->first; node; node = node->next) {
+        if (!emit_fsevent(&spill->emitter, &node->fsevent))
+            return -1;
+        spill->count++;
+    }
+
+    if (entry->acmtime) {
+        if (!emit_fsevent(&spill->emitter, &entry->acmtime->fsevent))
+            return -1;
+        spill->count++;
+    }
+    return 0;
+}
+
+static bool
+parser_expect(yaml_parser_t *parser, yaml_event_type_t type)
+{
+    yaml_event_t event;
+    bool match;
+
+    if (!yaml_parser_parse(parser, &event)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    match = event.type == type;
+    yaml_event_delete(&event);
+    if (!match)
+        errno = EINVAL;
+    return match;
+}
+
+/* Deduplicate the fsevents of the spill file in \p batch */
+static int
+spill_load(struct spill *spill, struct table *table, struct batch *batch)
+{
+    yaml_parser_t parser;
+    int save_errno;
+    off_t size;
+    void *map;
+    int rc = -1;
+
+    if (!yaml_emit_stream_end(&spill->emitter)
+     || !yaml_emitter_flush(&spill->emitter) || fflush(spill->file))
+        return -1;
+
+    size = ftello(spill->file);
+    if (size < 0)
+        return -1;
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(spill->file), 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    /* The file is read sequentially, exactly once */
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    if (!yaml_parser_initialize(&parser)) {
+        errno = ENOMEM;
+        goto out_munmap;
+    }
+
+    yaml_parser_set_input_string(&parser, map, size);
+    yaml_parser_set_encoding(&parser, YAML_UTF8_ENCODING);
+
+    if (!parser_expect(&parser, YAML_STREAM_START_EVENT))
+        goto out_delete_parser;
+
+    for (size_t i = 0; i < spill->count; i++) {
+        struct rbh_fsevent fsevent;
+
+        memset(&fsevent, 0, sizeof(fsevent));
+        if (!parser_expect(&parser, YAML_DOCUMENT_START_EVENT)
+         || !parse_fsevent(&parser, &fsevent)
+         || !parser_expect(&parser, YAML_DOCUMENT_END_EVENT))
+            goto out_delete_parser;
+
+        if (deduplicator_add(table, batch, &fsevent))
+            goto out_delete_parser;
+    }
+    rc = 0;
+
+out_delete_parser:
+    save_errno = errno;
+    yaml_parser_delete(&parser);
+    errno = save_errno;
+out_munmap:
+    save_errno = errno;
+    munmap(map, size);
+    errno = save_errno;
+    return rc;
+}
+
+/* Add the fsevents of \p entry to \p batch */
+static int
+entry_transfer(struct table *table, struct batch *batch,
+               const struct id_entry *entry)
+{
+    for (struct fsevent_node *node = entry->first; node; node = node->next) {
+        if (deduplicator_add(table, batch, &node->fsevent))
+            return -1;
+    }
+
+    if (entry->acmtime)
+        return deduplicator_add(table, batch, &entry->acmtime->fsevent);
+    return 0;
+}
+
+/* Spill the entries of \p batch that were not updated since the middle of
+ * the interval since the previous spill, and copy the others in a new batch
+ * that replaces \p batch.
+ */
+static int
+deduplicator_spill(struct deduplicator *deduplicator, struct batch **_batch)
+{
+    struct spill *spill = deduplicator->spill;
+    struct table *table = &deduplicator->table;
+    struct batch *batch = *_batch;
+    struct batch *hot;
+    size_t cold;
+    size_t count;
+    int save_errno;
+
+    hot = batch_new();
+    if (hot == NULL)
+        return -1;
+
+    cold = spill->clock + (table->clock - spill->clock) / 2;
+    count = spill->count;
+
+    table_clear(table);
+    for (struct id_entry *entry = batch->ids; entry; entry = entry->next) {
+        int rc = entry->touched < cold ? spill_entry(spill, entry)
+                                       : entry_transfer(table, hot, entry);
+        if (rc)
+            goto out_destroy_hot;
+    }
+
+    /* Do not spill again a few fsevents later if most entries are hot */
+    if (hot->size >= deduplicator->options.max_memory / 2) {
+        for (struct id_entry *entry = hot->ids; entry; entry = entry->next) {
+            if (spill_entry(spill, entry))
+                goto out_destroy_hot;
+        }
+
+        batch_iter_destroy(hot);
+        hot = batch_new();
+        if (hot == NULL)
+            return -1;
+        table_clear(table);
+    }
+
+    table->stats.spilled += spill->count - count;
+    spill->clock = table->clock;
+    batch_iter_destroy(batch);
+    *_batch = hot;
+    return 0;
+
+out_destroy_hot:
+    save_errno = errno;
+    batch_iter_destroy(hot);
+    errno = save_errno;
+    return -1;
+}
+
+/* Replace \p batch with a batch of the fsevents of the spill file, followed
+ * by those of \p batch.
+ */
+static int
+deduplicator_unspill(struct deduplicator *deduplicator, struct batch **_batch)
+{
+    struct table *table = &deduplicator->table;
+    struct batch *batch = *_batch;
+    struct batch *merged;
+    int save_errno;
+
+    merged = batch_new();
+    if (merged == NULL)
+        return -1;
+
+    table_clear(table);
+    if (spill_load(deduplicator->spill, table, merged))
+        goto out_destroy_merged;
+
+    for (struct id_entry *entry = batch->ids; entry; entry = entry->next) {
+        if (entry_transfer(table, merged, entry))
+            goto out_destroy_merged;
+    }
+
+    batch_iter_destroy(batch);
+    *_batch = merged;
+    return 0;
+
+out_destroy_merged:
+    save_errno = errno;
+    batch_iter_destroy(merged);
+    errno = save_errno;
+    return -1;
+}
+
 /*----------------------------------------------------------------------------*
- |                                deduplicator                                |
+ |                               sliding window                               |
+ *----------------------------------------------------------------------------*/
+
+/* In a sliding window, entries are not cut in batches: each of them is held
+ * from its first fsevent until max_delay later, and then released on its own
+ * in the next batch to be yielded. Time is that of the source: an entry is
+ * due once the source yields an fsevent that occurred after its deadline, or
+ * once it runs out of fsevents.
+ *
+ * Since every entry is held for the same delay, held entries are due in the
+ * order they were first seen, which is the order of the list of ids of the
+ * batch that holds them.
+ */
+
+struct window {
+    /* The batch entries are held in, whose ids are deduplicator->table */
+    struct batch *held;
+    /* Bytes of held that entries which were not released yet use */
+    size_t live;
+    /* The ids of the batch entries are released in */
+    struct table output;
+
+    /* Timestamp of the most recent fsevent the source yielded */
+    int64_t now;
+    /* Checkpoint of the source after the last fsevent it yielded */
+    uint64_t position;
+    /* Checkpoint of the source before the first fsevent still held */
+    uint64_t checkpoint;
+    bool exhausted;
+};
+
+static struct window *
+window_new(size_t batch_size)
+{
+    struct window *window;
+    int save_errno;
+
+    window = malloc(sizeof(*window));
+    if (window == NULL)
+        return NULL;
+
+    window->held = batch_new();
+    if (window->held == NULL)
+        goto out_free_window;
+
+    if (table_init(&window->output, batch_size))
+        goto out_destroy_held;
+
+    window->live = 0;
+    window->now = 0;
+    window->position = 0;
+    window->checkpoint = 0;
+    window->exhausted = false;
+    return window;
+
+out_destroy_held:
+    save_errno = errno;
+    batch_iter_destroy(window->held);
+    errno = save_errno;
+out_free_window:
+    save_errno = errno;
+    free(window);
+    errno = save_errno;
+    return NULL;
+}
+
+static void
+window_destroy(struct window *window)
+{
+    batch_iter_destroy(window->held);
+    free(window->output.slots);
+    free(window);
+}
+
+/* Add \p fsevent, which occurred at \p timestamp, to the held entries */
+static int
+window_add(struct deduplicator *deduplicator, const struct rbh_fsevent *fsevent,
+           int64_t timestamp)
+{
+    struct window *window = deduplicator->window;
+    struct batch *held = window->held;
+    struct id_entry *entry;
+    size_t size;
+
+    entry = table_get_entry(&deduplicator->table, held, &fsevent->id);
+    if (entry == NULL)
+        return -1;
+
+    if (entry->deadline == 0) {
+        entry->deadline = timestamp
+                        + timespec2ns(&deduplicator->options.max_delay);
+        entry->checkpoint = window->position;
+    }
+
+    size = held->size;
+    if (deduplicator_add(&deduplicator->table, held, fsevent))
+        return -1;
+
+    entry->size += held->size - size;
+    window->live += held->size - size;
+    return 0;
+}
+
+static bool
+window_is_due(struct deduplicator *deduplicator)
+{
+    struct window *window = deduplicator->window;
+    struct id_entry *entry = window->held->ids;
+
+    if (entry == NULL)
+        return false;
+
+    if (window->exhausted || entry->deadline <= window->now)
+        return true;
+
+    /* Release the oldest entries early rather than use too much memory */
+    return deduplicator->options.max_memory
+        && window->live >= deduplicator->options.max_memory;
+}
+
+/* Move the oldest held entry to \p batch, and count the fsevents it had in
+ * \p count.
+ */
+static int
+window_release(struct deduplicator *deduplicator, struct batch *batch,
+               size_t *count)
+{
+    struct window *window = deduplicator->window;
+    struct table *table = &deduplicator->table;
+    struct batch *held = window->held;
+    struct id_entry *entry = held->ids;
+
+    table_remove(table, table_find(table, entry->id, id_hash(entry->id)));
+    held->ids = entry->next;
+    if (held->ids == NULL)
+        held->tail = &held->ids;
+    window->live -= entry->size;
+
+    for (struct fsevent_node *node = entry->first; node; node = node->next)
+        (*count)++;
+    if (entry->acmtime)
+        (*count)++;
+
+    return entry_transfer(&window->output, batch, entry);
+}
+
+/* Copy the entries still held in a new batch, once released entries use as
+ * much memory as them.
+ */
+static int
+window_compact(struct deduplicator *deduplicator)
+{
+    struct window *window = deduplicator->window;
+    struct table *table = &deduplicator->table;
+    struct batch *held;
+
+    if (window->held->size - window->live < window->live
+     || window->held->size - window->live < FSEVENT_COPY_CHUNK_SIZE)
+        return 0;
+
+    held = batch_new();
+    if (held == NULL)
+        return -1;
+
+    table_clear(table);
+    window->live = 0;
+    for (struct id_entry *entry = window->held->ids; entry;
+         entry = entry->next) {
+        struct id_entry *copy;
+        size_t size = held->size;
+
+        copy = table_get_entry(table, held, entry->id);
+        if (copy == NULL || entry_transfer(table, held, entry))
+            goto out_destroy_held;
+
+        copy->created = entry->created;
+        copy->deadline = entry->deadline;
+        copy->checkpoint = entry->checkpoint;
+        copy->size = held->size - size;
+        window->live += copy->size;
+    }
+
+    batch_iter_destroy(window->held);
+    window->held = held;
+    return 0;
+
+out_destroy_held:
+    {
+        int save_errno = errno;
+
+        batch_iter_destroy(held);
+        errno = save_errno;
+    }
+    return -1;
+}
+
+/* Release due entries in a batch, reading the source until enough of them
+ * are due.
+ */
+static struct batch *
+window_next(struct deduplicator *deduplicator)
+{
+    struct window *window = deduplicator->window;
+    struct batch *batch;
+    size_t count = 0;
+    int save_errno;
+
+    batch = batch_new();
+    if (batch == NULL)
+        return NULL;
+
+    table_clear(&window->output);
+
+    while (true) {
+        const struct rbh_fsevent *fsevent;
+        struct timespec timestamp;
+
+        while (count < deduplicator->options.batch_size
+            && window_is_due(deduplicator)) {
+            if (window_release(deduplicator, batch, &count))
+                goto out_destroy_batch;
+        }
+
+        if (count >= deduplicator->options.batch_size)
+            break;
+
+        /* Nothing else is due, yield what was released unless the batch is
+         * to hold more fsevents.
+         */
+        if (count > 0 && count >= deduplicator->options.min_batch_size)
+            break;
+
+        if (window->exhausted)
+            break;
+
+        fsevent = rbh_iter_next(&deduplicator->source->fsevents);
+        if (fsevent == NULL) {
+            if (errno != ENODATA)
+                goto out_destroy_batch;
+            window->exhausted = true;
+            continue;
+        }
+        deduplicator_count(deduplicator, fsevent);
+
+        source_timestamp(deduplicator->source, &timestamp);
+        if (timespec2ns(&timestamp) > window->now)
+            window->now = timespec2ns(&timestamp);
+
+        if (window_add(deduplicator, fsevent, timespec2ns(&timestamp)))
+            goto out_destroy_batch;
+
+        window->position = source_checkpoint(deduplicator->source);
+    }
+
+    if (count == 0) {
+        batch_iter_destroy(batch);
+        errno = ENODATA;
+        return NULL;
+    }
+
+    if (window_compact(deduplicator))
+        goto out_destroy_batch;
+
+    window->checkpoint = window->held->ids ? window->held->ids->checkpoint
+                                           : window->position;
+    deduplicator_account(deduplicator, batch);
+    batch->entry = batch->ids;
+    return batch;
+
+out_destroy_batch:
+    save_errno = errno;
+    batch_iter_destroy(batch);
+    errno = save_errno;
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                   shards                                   |
  *----------------------------------------------------------------------------*/
 
+/* When sharded, the thread reading the source only copies fsevents in chunks,
+ * one per shard, depending on the hash of their id. Each shard owns a thread
+ * which deduplicates the fsevents of the chunks it receives in a batch of its
+ * own. When the batch is cut, the batches of every shard are concatenated:
+ * since every fsevent of a given id goes to the same shard, their order is
+ * preserved.
+ */
+
+#define CHUNK_SIZE (1 << 8)
+
+struct chunk {
+    struct rbh_fsevent fsevents[CHUNK_SIZE];
+    size_t count;
+};
+
+/* Marks the end of a batch in the stream of chunks of a shard */
+static struct chunk FLUSH;
+
+struct shard {
+    struct table table;
+    struct batch *batch;
+    /* Errors are reported when the batch is flushed */
+    int error;
+    /* The error of the last batch flushed, if any */
+    int status;
+
+    /* The chunk being filled by the reading thread */
+    struct chunk *chunk;
+    /* From the reading thread, a NULL chunk stops the shard */
+    struct ring *chunks;
+    /* To the reading thread, a NULL batch means an error occured (cf.
+     * status)
+     */
+    struct ring *batches;
+    pthread_t thread;
+};
+
+#define SHARD_DEPTH (1 << 6)
+
+static void
+shard_process(struct shard *shard, struct chunk *chunk)
+{
+    for (size_t i = 0; i < chunk->count && shard->error == 0; i++) {
+        if (deduplicator_add(&shard->table, shard->batch, &chunk->fsevents[i]))
+            shard->error = errno;
+    }
+    free(chunk);
+}
+
+static void
+shard_flush(struct shard *shard)
+{
+    struct batch *batch = shard->batch;
+
+    shard->status = shard->error;
+    if (shard->error && batch) {
+        batch_iter_destroy(batch);
+        batch = NULL;
+    }
+
+    shard->batch = batch_new();
+    if (shard->batch)
+        shard->batch->borrowed = true;
+    /* Without a batch, the shard fails until the next flush */
+    shard->error = shard->batch ? 0 : errno;
+    table_clear(&shard->table);
+
+    ring_push(shard->batches, batch);
+}
+
+static void *
+shard_routine(void *arg)
+{
+    struct shard *shard = arg;
+    struct chunk *chunk;
+
+    while ((chunk = ring_pop(shard->chunks)) != NULL) {
+        if (chunk == &FLUSH)
+            shard_flush(shard);
+        else if (shard->batch == NULL)
+            free(chunk);
+        else
+            shard_process(shard, chunk);
+    }
+
+    return NULL;
+}
+
+static void
+shards_fini(struct shard *shards, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        struct shard *shard = &shards[i];
+
+        ring_push(shard->chunks, NULL);
+        pthread_join(shard->thread, NULL);
+
+        if (shard->batch)
+            batch_iter_destroy(shard->batch);
+        free(shard->table.slots);
+        ring_destroy(shard->chunks);
+        ring_destroy(shard->batches);
+    }
+    free(shards);
+}
+
+static struct shard *
+shards_init(size_t count, size_t batch_size)
+{
+    struct shard *shards;
+    int save_errno;
+    size_t i;
+
+    shards = calloc(count, sizeof(*shards));
+    if (shards == NULL)
+        return NULL;
+
+    for (i = 0; i < count; i++) {
+        struct shard *shard = &shards[i];
+
+        /* Shards receive batch_size / count ids on average, tables grow to
+         * absorb imbalances.
+         */
+        if (table_init(&shard->table, batch_size / count + 1))
+            goto out_fini;
+
+        shard->batch = batch_new();
+        if (shard->batch == NULL)
+            goto out_free_table;
+        shard->batch->borrowed = true;
+
+        shard->chunks = ring_new(SHARD_DEPTH);
+        if (shard->chunks == NULL)
+            goto out_destroy_batch;
+
+        shard->batches = ring_new(1);
+        if (shard->batches == NULL)
+            goto out_destroy_chunks;
+
+        errno = pthread_create(&shard->thread, NULL, shard_routine, shard);
+        if (errno)
+            goto out_destroy_batches;
+    }
+
+    return shards;
+
+out_destroy_batches:
+    ring_destroy(shards[i].batches);
+out_destroy_chunks:
+    ring_destroy(shards[i].chunks);
+out_destroy_batch:
+    batch_iter_destroy(shards[i].batch);
+out_free_table:
+    free(shards[i].table.slots);
+out_fini:
+    save_errno = errno;
+    shards_fini(shards, i);
+    errno = save_errno;
+    return NULL;
+}
+
+/* Copy \p fsevent in the chunk of the shard responsible for its id */
+static int
+shards_add(struct shard *shards, size_t count, struct batch *batch,
+           const struct rbh_fsevent *fsevent, bool borrowed)
+{
+    struct shard *shard = &shards[id_hash(&fsevent->id) % count];
+    struct chunk *chunk = shard->chunk;
+
+    if (chunk == NULL) {
+        chunk = malloc(sizeof(*chunk));
+        if (chunk == NULL)
+            return -1;
+        chunk->count = 0;
+        shard->chunk = chunk;
+    }
+
+    if (borrowed)
+        chunk->fsevents[chunk->count] = *fsevent;
+    else if (fsevent_copy(&chunk->fsevents[chunk->count], fsevent,
+                          batch->values))
+        return -1;
+    batch->size += fsevent_size(fsevent);
+
+    if (++chunk->count == CHUNK_SIZE) {
+        ring_push(shard->chunks, chunk);
+        shard->chunk = NULL;
+    }
+    return 0;
+}
+
+/* Collect the batch of every shard into \p batch, even on error */
+static int
+shards_flush(struct shard *shards, size_t count, struct batch *batch)
+{
+    int error = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        struct shard *shard = &shards[i];
+
+        if (shard->chunk) {
+            ring_push(shard->chunks, shard->chunk);
+            shard->chunk = NULL;
+        }
+        ring_push(shard->chunks, &FLUSH);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct batch *shard_batch = ring_pop(shards[i].batches);
+
+        if (shard_batch == NULL)
+            error = shards[i].status;
+        else
+            batch_absorb(batch, shard_batch);
+    }
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/* Gather the statistics of \p batch, which is about to be yielded */
+static void
+deduplicator_account(struct deduplicator *deduplicator,
+                     const struct batch *batch)
+{
+    struct deduplicator_stats *stats = &deduplicator->stats;
+
+    for (struct id_entry *entry = batch->ids; entry; entry = entry->next) {
+        for (struct fsevent_node *node = entry->first; node; node = node->next)
+            count_type(stats->out, node->fsevent.type);
+        if (entry->acmtime)
+            count_type(stats->out, RBH_FET_UPSERT);
+    }
+
+    stats_collect(stats, &deduplicator->table.stats);
+    for (size_t i = 0; i < deduplicator->shard_count; i++)
+        stats_collect(stats, &deduplicator->shards[i].table.stats);
+    if (deduplicator->window)
+        stats_collect(stats, &deduplicator->window->output.stats);
+
+    if (deduplicator->options.report)
+        deduplicator->options.report(stats);
+
+    pthread_mutex_lock(&cumulative_lock);
+    stats_collect(&cumulative, stats);
+    pthread_mutex_unlock(&cumulative_lock);
+}
+
 static void *
 deduplicator_iter_next(void *iterator)
 {
     struct deduplicator *deduplicator = iterator;
-    const struct rbh_fsevent *fsevent;
+    const struct rbh_fsevent *fsevent = NULL;
+    struct timespec start;
+    struct batch *batch;
+    int save_errno;
+    int rc = 0;
+    size_t i;
+
+    if (deduplicator->window)
+        return window_next(deduplicator);
+
+    batch = batch_new();
+    if (batch == NULL)
+        return NULL;
+    batch->borrowed = deduplicator->borrowed;
+
+    if (deduplicator->shards == NULL)
+        table_clear(&deduplicator->table);
+
+    if (deduplicator->spill && deduplicator->spill->count
+     && spill_reset(deduplicator->spill)) {
+        save_errno = errno;
+        batch_iter_destroy(batch);
+        errno = save_errno;
+        return NULL;
+    }
+
+    for (i = 0; i < deduplicator->options.batch_size; i++) {
+        fsevent = rbh_iter_next(&deduplicator->source->fsevents);
+        if (fsevent == NULL)
+            break;
+        deduplicator_count(deduplicator, fsevent);
+
+        if (i == 0)
+            source_timestamp(deduplicator->source, &start);
+
+        if (deduplicator->shards) {
+            rc = shards_add(deduplicator->shards, deduplicator->shard_count,
+                            batch, fsevent, deduplicator->borrowed);
+        } else {
+            rc = deduplicator_add(&deduplicator->table, batch, fsevent);
+            /* The source retains the fsevent on behalf of the batch */
+            if (deduplicator->borrowed && deduplicator->options.max_memory)
+                batch->size += fsevent_size(fsevent);
+        }
+        if (rc)
+            break;
+
+        if (deduplicator->options.max_memory
+         && batch->size >= deduplicator->options.max_memory) {
+            if (deduplicator->spill == NULL)
+                break;
+
+            rc = deduplicator_spill(deduplicator, &batch);
+            if (rc)
+                break;
+        }
 
-    fsevent = rbh_iter_next(&deduplicator->source->fsevents);
-    if (fsevent == NULL)
+        if (deduplicator_is_late(deduplicator, timespec2ns(&start), i + 1))
+            break;
+    }
+
+    if (rc == 0 && fsevent == NULL && (errno != ENODATA || i == 0))
+        rc = -1;
+
+    if (rc == 0 && deduplicator->spill && deduplicator->spill->count)
+        rc = deduplicator_unspill(deduplicator, &batch);
+    save_errno = errno;
+
+    /* Shards must flush their batch even on error, to start the next one
+     * afresh.
+     */
+    if (deduplicator->shards
+     && shards_flush(deduplicator->shards, deduplicator->shard_count, batch)
+     && rc == 0) {
+        rc = -1;
+        save_errno = errno;
+    }
+
+    if (rc) {
+        batch_iter_destroy(batch);
+        errno = save_errno;
         return NULL;
+    }
 
-    return rbh_iter_array(fsevent, sizeof(fsevent), 1);
+    deduplicator_account(deduplicator, batch);
+    batch->entry = batch->ids;
+    return batch;
 }
 
 static void
@@ -40,6 +2288,13 @@ deduplicator_iter_destroy(void *iterator)
 {
     struct deduplicator *deduplicator = iterator;
 
+    if (deduplicator->shards)
+        shards_fini(deduplicator->shards, deduplicator->shard_count);
+    if (deduplicator->spill)
+        spill_destroy(deduplicator->spill);
+    if (deduplicator->window)
+        window_destroy(deduplicator->window);
+    free(deduplicator->table.slots);
     free(deduplicator);
 }
 
@@ -52,16 +2307,82 @@ static const struct rbh_mut_iterator DEDUPLICATOR_ITERATOR = {
     .ops = &DEDUPLICATOR_ITER_OPS,
 };
 
+uint64_t
+deduplicator_checkpoint(struct rbh_mut_iterator *batches)
+{
+    struct deduplicator *deduplicator = (struct deduplicator *)batches;
+
+    if (deduplicator->window)
+        return deduplicator->window->checkpoint;
+    return source_checkpoint(deduplicator->source);
+}
+
 struct rbh_mut_iterator *
-deduplicator_new(size_t count __attribute__((unused)), struct source *source)
+deduplicator_new(const struct deduplicator_options *options,
+                 struct source *source)
 {
     struct deduplicator *deduplicator;
+    int save_errno;
+
+    if (options->batch_size == 0
+     || options->min_batch_size > options->batch_size
+     || (options->spill_directory && options->shards > 1)
+     || (options->sliding && (options->shards > 1 || options->spill_directory
+                           || timespec2ns(&options->max_delay) == 0))) {
+        errno = EINVAL;
+        return NULL;
+    }
 
     deduplicator = malloc(sizeof(*deduplicator));
     if (deduplicator == NULL)
         return NULL;
 
+    deduplicator->table.slots = NULL;
+    deduplicator->spill = NULL;
+    deduplicator->window = NULL;
+    memset(&deduplicator->stats, 0, sizeof(deduplicator->stats));
+    deduplicator->shards = NULL;
+    deduplicator->shard_count = 0;
+
+    if (options->shards > 1) {
+        deduplicator->shards = shards_init(options->shards,
+                                           options->batch_size);
+        if (deduplicator->shards == NULL)
+            goto out_free_deduplicator;
+        deduplicator->shard_count = options->shards;
+    } else {
+        /* A batch never holds more ids than fsevents */
+        if (table_init(&deduplicator->table, options->batch_size))
+            goto out_free_deduplicator;
+    }
+
+    if (options->spill_directory) {
+        deduplicator->spill = spill_new(options->spill_directory);
+        if (deduplicator->spill == NULL)
+            goto out_free_slots;
+    }
+
+    if (options->sliding) {
+        deduplicator->window = window_new(options->batch_size);
+        if (deduplicator->window == NULL)
+            goto out_free_slots;
+    }
+
+    /* Spilled and held entries outlive the batch they were read in */
+    deduplicator->borrowed = source->retains && !deduplicator->spill
+                          && !deduplicator->window;
     deduplicator->batches = DEDUPLICATOR_ITERATOR;
     deduplicator->source = source;
+    deduplicator->options = *options;
     return &deduplicator->batches;
+
+out_free_slots:
+    save_errno = errno;
+    free(deduplicator->table.slots);
+    errno = save_errno;
+out_free_deduplicator:
+    save_errno = errno;
+    free(deduplicator);
+    errno = save_errno;
+    return NULL;
 }
@@ -13,6 +13,15 @@
 #include "enricher.h"
 #include "enrichers/internals.h"
 
+void
+enrich_reset(void)
+{
+    posix_enrich_reset();
+#ifdef HAVE_LUSTRE
+    lustre_enrich_reset();
+#endif
+}
+
 struct enrich_iter_builder *
 enrich_iter_builder_from_backend(struct rbh_backend *backend,
                                  const char *mount_path)
@@ -0,0 +1,402 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include "enricher.h"
+#include "internals.h"
+#include "utils.h"
+
+/* Maximum number of descriptors a thread keeps open */
+#define FD_CACHE_SIZE 1024
+/* Number of ids known not to exist anymore a thread remembers */
+#define NEGATIVE_CACHE_SIZE 4096
+
+struct fd_entry {
+    struct rbh_id id;
+    size_t hash;
+    /* Always an O_PATH descriptor */
+    int fd;
+
+    /* Next entry in the same bucket */
+    struct fd_entry *next;
+    /* Least recently used entries come first */
+    struct fd_entry *lru_prev;
+    struct fd_entry *lru_next;
+};
+
+/* Ids that could not be opened because they no longer exist, with a single
+ * entry per bucket: newer ids replace older ones.
+ */
+struct negative_entry {
+    struct rbh_id id;
+    size_t hash;
+    /* CLOCK_MONOTONIC, in nanoseconds */
+    int64_t expiry;
+};
+
+struct fd_cache {
+    struct fd_entry *buckets[FD_CACHE_SIZE];
+    struct fd_entry lru;
+    size_t count;
+
+    struct negative_entry negatives[NEGATIVE_CACHE_SIZE];
+};
+
+/* Every thread has its own cache, but they share the budget of descriptors
+ * the process is allowed to keep open.
+ */
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static int cache_key_error;
+static atomic_size_t cached_fds;
+static size_t max_cached_fds;
+
+static int64_t negative_ttl = INT64_C(10000000000); /* 10s */
+
+static atomic_size_t lookups;
+static atomic_size_t fd_hits;
+static atomic_size_t negative_hits;
+static atomic_size_t opens;
+static atomic_size_t skipped;
+
+void
+enrich_set_negative_ttl(const struct timespec *ttl)
+{
+    negative_ttl = ttl->tv_sec * INT64_C(1000000000) + ttl->tv_nsec;
+}
+
+void
+enrich_get_stats(struct enrich_stats *stats)
+{
+    stats->lookups = atomic_load(&lookups);
+    stats->fd_hits = atomic_load(&fd_hits);
+    stats->negative_hits = atomic_load(&negative_hits);
+    stats->opens = atomic_load(&opens);
+    stats->skipped = atomic_load(&skipped);
+}
+
+static int64_t
+monotonic_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * INT64_C(1000000000) + now.tv_nsec;
+}
+
+static struct negative_entry *
+negative_entry(struct fd_cache *cache, size_t hash)
+{
+    return &cache->negatives[hash % NEGATIVE_CACHE_SIZE];
+}
+
+/* Whether \p id is known not to exist anymore */
+static bool
+negative_lookup(struct fd_cache *cache, const struct rbh_id *id, size_t hash)
+{
+    struct negative_entry *entry = negative_entry(cache, hash);
+
+    return entry->id.data != NULL && entry->hash == hash
+        && id_equal(&entry->id, id) && monotonic_now() < entry->expiry;
+}
+
+static void
+negative_insert(struct fd_cache *cache, const struct rbh_id *id, size_t hash)
+{
+    struct negative_entry *entry = negative_entry(cache, hash);
+    char *data;
+
+    /* The negative cache is only an optimization, ignore errors */
+    data = malloc(id->size ? id->size : 1);
+    if (data == NULL)
+        return;
+
+    free((char *)entry->id.data);
+    memcpy(data, id->data, id->size);
+    entry->id.data = data;
+    entry->id.size = id->size;
+    entry->hash = hash;
+    entry->expiry = monotonic_now() + negative_ttl;
+}
+
+static void
+lru_unlink(struct fd_entry *entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void
+lru_append(struct fd_cache *cache, struct fd_entry *entry)
+{
+    entry->lru_prev = cache->lru.lru_prev;
+    entry->lru_next = &cache->lru;
+    cache->lru.lru_prev->lru_next = entry;
+    cache->lru.lru_prev = entry;
+}
+
+static struct fd_entry **
+fd_cache_find(struct fd_cache *cache, const struct rbh_id *id, size_t hash)
+{
+    struct fd_entry **entry = &cache->buckets[hash % FD_CACHE_SIZE];
+
+    for (; *entry; entry = &(*entry)->next) {
+        if ((*entry)->hash == hash && id_equal(&(*entry)->id, id))
+            break;
+    }
+    return entry;
+}
+
+static void
+fd_cache_remove(struct fd_cache *cache, struct fd_entry **slot)
+{
+    struct fd_entry *entry = *slot;
+
+    *slot = entry->next;
+    lru_unlink(entry);
+    /* Ignore errors on close */
+    close(entry->fd);
+    free(entry);
+
+    cache->count--;
+    atomic_fetch_sub_explicit(&cached_fds, 1, memory_order_relaxed);
+}
+
+static void
+fd_cache_evict(struct fd_cache *cache)
+{
+    struct fd_entry *oldest = cache->lru.lru_next;
+
+    fd_cache_remove(cache, fd_cache_find(cache, &oldest->id, oldest->hash));
+}
+
+static void
+fd_cache_destroy(void *_cache)
+{
+    struct fd_cache *cache = _cache;
+
+    while (cache->count > 0)
+        fd_cache_evict(cache);
+    for (size_t i = 0; i < NEGATIVE_CACHE_SIZE; i++)
+        free((char *)cache->negatives[i].id.data);
+    free(cache);
+}
+
+static void
+fd_cache_init_once(void)
+{
+    struct rlimit rlimit;
+
+    /* Leave at least half the descriptors to the rest of the process */
+    if (getrlimit(RLIMIT_NOFILE, &rlimit) == 0
+     && rlimit.rlim_cur != RLIM_INFINITY)
+        max_cached_fds = rlimit.rlim_cur / 2;
+    else
+        max_cached_fds = FD_CACHE_SIZE;
+
+    cache_key_error = pthread_key_create(&cache_key, fd_cache_destroy);
+}
+
+static struct fd_cache *
+fd_cache_get(void)
+{
+    struct fd_cache *cache;
+
+    pthread_once(&cache_once, fd_cache_init_once);
+    if (cache_key_error) {
+        errno = cache_key_error;
+        return NULL;
+    }
+
+    cache = pthread_getspecific(cache_key);
+    if (cache != NULL)
+        return cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+
+    cache->lru.lru_prev = &cache->lru;
+    cache->lru.lru_next = &cache->lru;
+    errno = pthread_setspecific(cache_key, cache);
+    if (errno) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+int
+fd_cache_open(int mount_fd, const struct rbh_id *id, bool io)
+{
+    struct fd_cache *cache = fd_cache_get();
+    struct fd_entry **slot;
+    struct fd_entry *entry;
+    int save_errno;
+    size_t hash;
+    int fd;
+
+    if (cache == NULL)
+        return -1;
+
+    hash = id_hash(id);
+
+    atomic_fetch_add_explicit(&lookups, 1, memory_order_relaxed);
+    if (negative_ttl > 0 && negative_lookup(cache, id, hash)) {
+        atomic_fetch_add_explicit(&negative_hits, 1, memory_order_relaxed);
+        errno = ESTALE;
+        return -1;
+    }
+
+    slot = fd_cache_find(cache, id, hash);
+    if (*slot && !io) {
+        atomic_fetch_add_explicit(&fd_hits, 1, memory_order_relaxed);
+        lru_unlink(*slot);
+        lru_append(cache, *slot);
+        return (*slot)->fd;
+    }
+
+    atomic_fetch_add_explicit(&opens, 1, memory_order_relaxed);
+    fd = open_entry(mount_fd, id, io);
+    if (fd < 0) {
+        if (negative_ttl > 0 && (errno == ESTALE || errno == ENOENT)) {
+            save_errno = errno;
+            negative_insert(cache, id, hash);
+            errno = save_errno;
+        }
+        return -1;
+    }
+
+    /* Descriptors that allow I/O keep the entry open on the servers (on Lustre,
+     * an unlinked entry keeps its objects until it is closed). They are only
+     * kept for the fsevent they were opened for, whichever thread or batch
+     * sees the entry deleted.
+     */
+    if (io)
+        return fd;
+
+    entry = malloc(sizeof(*entry) + id->size);
+    if (entry == NULL)
+        goto out_close;
+
+    while (cache->count > 0
+        && (cache->count >= FD_CACHE_SIZE
+         || atomic_load_explicit(&cached_fds, memory_order_relaxed)
+                >= max_cached_fds))
+        fd_cache_evict(cache);
+
+    entry->id.data = (char *)(entry + 1);
+    entry->id.size = id->size;
+    memcpy((char *)entry->id.data, id->data, id->size);
+    entry->hash = hash;
+    entry->fd = fd;
+
+    slot = fd_cache_find(cache, id, hash);
+    entry->next = NULL;
+    *slot = entry;
+    lru_append(cache, entry);
+
+    cache->count++;
+    atomic_fetch_add_explicit(&cached_fds, 1, memory_order_relaxed);
+    return fd;
+
+out_close:
+    save_errno = errno;
+    close(fd);
+    errno = save_errno;
+    return -1;
+}
+
+void
+fd_cache_release(int fd, bool io)
+{
+    /* Ignore errors on close */
+    if (io)
+        close(fd);
+}
+
+void
+fd_cache_invalidate(const struct rbh_id *id)
+{
+    struct fd_cache *cache = fd_cache_get();
+    struct fd_entry **slot;
+
+    if (cache == NULL)
+        return;
+
+    slot = fd_cache_find(cache, id, id_hash(id));
+    if (*slot)
+        fd_cache_remove(cache, slot);
+}
+
+static int
+enrich_fsevent(struct enricher *enricher, const struct rbh_fsevent *original,
+               int (*enrich)(struct enricher *enricher,
+                             const struct rbh_fsevent *original, int fd))
+{
+    enum entry_access access = partials_access(original);
+    int save_errno;
+    int fd;
+    int rc;
+
+    switch (original->type) {
+    case RBH_FET_UNLINK:
+    case RBH_FET_DELETE:
+        fd_cache_invalidate(&original->id);
+        break;
+    default:
+        break;
+    }
+
+    if (access == EA_NONE)
+        return enrich(enricher, original, -1);
+
+    fd = fd_cache_open(enricher->mount_fd, &original->id, access == EA_IO);
+    if (fd < 0)
+        return -1;
+
+    rc = enrich(enricher, original, fd);
+    save_errno = errno;
+    fd_cache_release(fd, access == EA_IO);
+    errno = save_errno;
+    return rc;
+}
+
+const void *
+enricher_next(struct enricher *enricher,
+              int (*enrich)(struct enricher *enricher,
+                            const struct rbh_fsevent *original, int fd))
+{
+    const struct rbh_fsevent *fsevent;
+
+    while (true) {
+        fsevent = rbh_iter_next(enricher->fsevents);
+        if (fsevent == NULL)
+            return NULL;
+
+        if (enrich_fsevent(enricher, fsevent, enrich) == 0)
+            return &enricher->fsevent;
+
+        /* The entry was deleted after the fsevent was emitted: there is
+         * nothing left to enrich, skip it rather than fail the whole batch.
+         * A later fsevent of the changelog records the deletion itself.
+         */
+        if (errno != ESTALE && errno != ENOENT)
+            return NULL;
+
+        atomic_fetch_add_explicit(&skipped, 1, memory_order_relaxed);
+    }
+}
@@ -3,6 +3,8 @@
 #ifndef ENRICHER_INTERNALS_H
 #define ENRICHER_INTERNALS_H
 
+#include <stdbool.h>
+
 #include <robinhood.h>
 
 struct enricher {
@@ -24,6 +26,53 @@ struct enricher {
 int
 open_by_id(int mound_fd, const struct rbh_id *id, int flags);
 
+/* What kind of descriptor enriching an fsevent requires */
+enum entry_access {
+    EA_NONE,    /* no descriptor at all */
+    EA_PATH,    /* an O_PATH descriptor is enough */
+    EA_IO,      /* a descriptor that allows reading (eg. xattrs) */
+};
+
+enum entry_access
+partials_access(const struct rbh_fsevent *fsevent);
+
+/* Open the entry \p id refers to, only with O_PATH unless \p io is true.
+ *
+ * Symlinks cannot be opened without O_PATH, they always are.
+ */
+int
+open_entry(int mount_fd, const struct rbh_id *id, bool io);
+
+/* Same as open_entry(), but O_PATH descriptors are cached across fsevents.
+ *
+ * Each thread has its own cache of the descriptors it most recently used,
+ * bounded both in size and by RLIMIT_NOFILE. Descriptors opened for I/O are
+ * never cached. Either way, callers must give returned descriptors back with
+ * fd_cache_release() rather than close them.
+ */
+int
+fd_cache_open(int mount_fd, const struct rbh_id *id, bool io);
+
+/* Give back a descriptor fd_cache_open() returned, \p io must be the same */
+void
+fd_cache_release(int fd, bool io);
+
+/* Close the descriptor the cache may hold for \p id, eg. once it is deleted */
+void
+fd_cache_invalidate(const struct rbh_id *id);
+
+/* The next fsevent of \p enricher, enriched by \p enrich
+ *
+ * The entry an fsevent targets is opened at most once (through the descriptor
+ * cache), and \p enrich is given that descriptor for every partial field, or
+ * -1 if none requires one. Fsevents of entries that no longer exist are
+ * skipped.
+ */
+const void *
+enricher_next(struct enricher *enricher,
+              int (*enrich)(struct enricher *enricher,
+                            const struct rbh_fsevent *original, int fd));
+
 /*----------------------------------------------------------------------------*
  *                              posix internals                               *
  *----------------------------------------------------------------------------*/
@@ -31,7 +80,7 @@ open_by_id(int mound_fd, const struct rbh_id *id, int flags);
 int posix_enrich(const struct rbh_value_pair *partial,
                  struct rbh_value_pair **pairs, size_t *pair_count,
                  struct rbh_fsevent *enriched,
-                 const struct rbh_fsevent *original, int mount_fd,
+                 const struct rbh_fsevent *original, int fd,
                  struct rbh_statx *statxbuf, char symlink[]);
 
 struct rbh_iterator *
@@ -44,6 +93,20 @@ posix_enricher_iter_destroy(void *iterator);
 void
 posix_enrich_iter_builder_destroy(void *_enrich);
 
+/* Free the values the posix enrichers of the calling thread allocated */
+void
+posix_enrich_reset(void);
+
+/*----------------------------------------------------------------------------*
+ *                              lustre internals                              *
+ *----------------------------------------------------------------------------*/
+
+#ifdef HAVE_LUSTRE
+/* Free the values the lustre enrichers of the calling thread allocated */
+void
+lustre_enrich_reset(void);
+#endif
+
 /*----------------------------------------------------------------------------*
  *                       enrich iter builder interfaces                       *
  *----------------------------------------------------------------------------*/
@@ -26,6 +26,14 @@ exit_xattrs_values(void)
         rbh_sstack_destroy(xattrs_values);
 }
 
+void
+lustre_enrich_reset(void)
+{
+    /* The stack is allocated again on demand */
+    exit_xattrs_values();
+    xattrs_values = NULL;
+}
+
 static int
 enrich_path(const char *mount_path, const struct rbh_id *id, const char *name,
             struct rbh_sstack *xattrs_values, struct rbh_value **_value)
@@ -87,9 +95,8 @@ enrich_path(const char *mount_path, const struct rbh_id *id, const char *name,
 }
 
 static int
-enrich_lustre(struct rbh_backend *backend, int mount_fd,
-              const struct rbh_id *id, struct rbh_sstack *xattrs_values,
-              struct rbh_value_pair *pair)
+enrich_lustre(struct rbh_backend *backend, int fd,
+              struct rbh_sstack *xattrs_values, struct rbh_value_pair *pair)
 {
     static const int STATX_FLAGS = AT_STATX_FORCE_SYNC | AT_EMPTY_PATH
                                  | AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW;
@@ -99,42 +106,20 @@ enrich_lustre(struct rbh_backend *backend, int mount_fd,
         struct rbh_sstack *values;
     } arg;
     struct rbh_statx statxbuf;
-    int save_errno;
-    int size;
-    int rc;
-
-    arg.fd = open_by_id(mount_fd, id, O_RDONLY | O_CLOEXEC | O_NOFOLLOW |
-                                      O_NONBLOCK);
-    if (arg.fd < 0 && errno == ELOOP)
-        /* If the file to open is a symlink, reopen it with O_PATH set */
-        arg.fd = open_by_id(mount_fd, id,
-                            O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_PATH);
-    if (arg.fd < 0)
-        return -1;
 
-    rc = rbh_statx(arg.fd, "", STATX_FLAGS, RBH_STATX_MODE, &statxbuf);
-    if (rc == -1) {
-        save_errno = errno;
-        close(arg.fd);
-        errno = save_errno;
+    if (rbh_statx(fd, "", STATX_FLAGS, RBH_STATX_MODE, &statxbuf))
         return -1;
-    }
 
+    arg.fd = fd;
     arg.mode = statxbuf.stx_mode;
     arg.values = xattrs_values;
 
-    size = rbh_backend_get_attribute(backend, "lustre", &arg, pair);
-
-    save_errno = errno;
-    close(arg.fd);
-    errno = save_errno;
-
-    return size;
+    return rbh_backend_get_attribute(backend, "lustre", &arg, pair);
 }
 
 static int
 lustre_enrich(struct enricher *enricher, const struct rbh_value_pair *attr,
-              const struct rbh_fsevent *original)
+              const struct rbh_fsevent *original, int fd)
 {
     struct rbh_value_pair *pairs = enricher->pairs;
     int size;
@@ -162,8 +147,7 @@ lustre_enrich(struct enricher *enricher, const struct rbh_value_pair *attr,
     }
 
     if (strcmp(attr->key, "lustre") == 0) {
-        size = enrich_lustre(enricher->backend, enricher->mount_fd,
-                             &original->id, xattrs_values,
+        size = enrich_lustre(enricher->backend, fd, xattrs_values,
                              &pairs[enricher->fsevent.xattrs.count]);
         if (size == -1)
             return -1;
@@ -173,13 +157,13 @@ lustre_enrich(struct enricher *enricher, const struct rbh_value_pair *attr,
         return size;
     }
 
-    return posix_enrich(attr, &pairs, &enricher->pair_count, &enricher->fsevent,
-                        original, enricher->mount_fd, &enricher->statx,
+    return posix_enrich(attr, &enricher->pairs, &enricher->pair_count,
+                        &enricher->fsevent, original, fd, &enricher->statx,
                         enricher->symlink);
 }
 
 static int
-enrich(struct enricher *enricher, const struct rbh_fsevent *original)
+_enrich(struct enricher *enricher, const struct rbh_fsevent *original, int fd)
 {
     struct rbh_fsevent *enriched = &enricher->fsevent;
     struct rbh_value_pair *pairs = enricher->pairs;
@@ -215,10 +199,13 @@ enrich(struct enricher *enricher, const struct rbh_fsevent *original)
         for (size_t i = 0; i < partials->count; i++) {
             int rc;
 
-            rc = lustre_enrich(enricher, &partials->pairs[i], original);
+            rc = lustre_enrich(enricher, &partials->pairs[i], original, fd);
             if (rc == -1)
                 return -1;
         }
+        /* Enriching xattrs may have reallocated pairs */
+        pairs = enricher->pairs;
+        pair_count = enricher->pair_count;
 
     }
     enriched->xattrs.pairs = pairs;
@@ -229,17 +216,7 @@ enrich(struct enricher *enricher, const struct rbh_fsevent *original)
 static const void *
 lustre_enricher_iter_next(void *iterator)
 {
-    struct enricher *enricher = iterator;
-    const void *fsevent;
-
-    fsevent = rbh_iter_next(enricher->fsevents);
-    if (fsevent == NULL)
-        return NULL;
-
-    if (enrich(enricher, fsevent))
-        return NULL;
-
-    return &enricher->fsevent;
+    return enricher_next(iterator, _enrich);
 }
 
 static const struct rbh_iterator_operations LUSTRE_ENRICHER_ITER_OPS = {
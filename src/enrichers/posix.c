@@ -20,6 +20,7 @@
 
 #include "enricher.h"
 #include "internals.h"
+#include "utils.h"
 
 enum statx_field {
     SF_UNKNOWN,
@@ -376,81 +377,46 @@ str2partial_field(const char *string)
     return PF_UNKNOWN;
 }
 
-static void
-merge_statx(struct rbh_statx *original, const struct rbh_statx *override)
+static enum entry_access
+partial_access(const char *key)
 {
-    original->stx_mask |= override->stx_mask;
-
-    if (override->stx_mask & RBH_STATX_TYPE)
-        original->stx_mode |= override->stx_mode & S_IFMT;
-
-    if (override->stx_mask & RBH_STATX_MODE)
-        original->stx_mode |= override->stx_mode & ~S_IFMT;
-
-    if (override->stx_mask & RBH_STATX_NLINK)
-        original->stx_nlink = override->stx_nlink;
-
-    if (override->stx_mask & RBH_STATX_UID)
-        original->stx_uid = override->stx_uid;
-
-    if (override->stx_mask & RBH_STATX_GID)
-        original->stx_gid = override->stx_gid;
-
-    if (override->stx_mask & RBH_STATX_ATIME_SEC)
-        original->stx_atime.tv_sec = override->stx_atime.tv_sec;
-
-    if (override->stx_mask & RBH_STATX_CTIME_SEC)
-        original->stx_ctime.tv_sec = override->stx_ctime.tv_sec;
-
-    if (override->stx_mask & RBH_STATX_MTIME_SEC)
-        original->stx_mtime.tv_sec = override->stx_mtime.tv_sec;
-
-    if (override->stx_mask & RBH_STATX_INO)
-        original->stx_ino = override->stx_ino;
-
-    if (override->stx_mask & RBH_STATX_SIZE)
-        original->stx_size = override->stx_size;
-
-    if (override->stx_mask & RBH_STATX_BLOCKS)
-        original->stx_blocks = override->stx_blocks;
-
-    if (override->stx_mask & RBH_STATX_BTIME_SEC)
-        original->stx_btime.tv_sec = override->stx_btime.tv_sec;
-
-    if (override->stx_mask & RBH_STATX_MNT_ID)
-        original->stx_mnt_id = override->stx_mnt_id;
-
-    if (override->stx_mask & RBH_STATX_BLKSIZE)
-        original->stx_blksize = override->stx_blksize;
-
-    if (override->stx_mask & RBH_STATX_ATTRIBUTES) {
-        original->stx_attributes_mask = override->stx_attributes_mask;
-        original->stx_attributes = override->stx_attributes;
+    switch (str2partial_field(key)) {
+    case PF_STATX:
+    case PF_SYMLINK:
+        return EA_PATH;
+    case PF_XATTRS:
+        return EA_IO;
+    case PF_UNKNOWN:
+        break;
     }
 
-    if (override->stx_mask & RBH_STATX_ATIME_NSEC)
-        original->stx_atime.tv_nsec = override->stx_atime.tv_nsec;
-
-    if (override->stx_mask & RBH_STATX_BTIME_NSEC)
-        original->stx_btime.tv_nsec = override->stx_btime.tv_nsec;
-
-    if (override->stx_mask & RBH_STATX_CTIME_NSEC)
-        original->stx_ctime.tv_nsec = override->stx_ctime.tv_nsec;
+    /* Lustre specific partial fields */
+    if (strcmp(key, "lustre") == 0)
+        return EA_IO;
+    return EA_NONE;
+}
 
-    if (override->stx_mask & RBH_STATX_MTIME_NSEC)
-        original->stx_mtime.tv_nsec = override->stx_mtime.tv_nsec;
+enum entry_access
+partials_access(const struct rbh_fsevent *fsevent)
+{
+    enum entry_access access = EA_NONE;
 
-    if (override->stx_mask & RBH_STATX_RDEV_MAJOR)
-        original->stx_rdev_major = override->stx_rdev_major;
+    for (size_t i = 0; i < fsevent->xattrs.count; i++) {
+        const struct rbh_value_pair *pair = &fsevent->xattrs.pairs[i];
 
-    if (override->stx_mask & RBH_STATX_RDEV_MINOR)
-        original->stx_rdev_minor = override->stx_rdev_minor;
+        if (strcmp(pair->key, "rbh-fsevents") || pair->value == NULL
+         || pair->value->type != RBH_VT_MAP)
+            continue;
 
-    if (override->stx_mask & RBH_STATX_DEV_MAJOR)
-        original->stx_dev_major = override->stx_dev_major;
+        for (size_t j = 0; j < pair->value->map.count; j++) {
+            enum entry_access partial;
 
-    if (override->stx_mask & RBH_STATX_DEV_MINOR)
-        original->stx_dev_minor = override->stx_dev_minor;
+            partial = partial_access(pair->value->map.pairs[j].key);
+            if (partial > access)
+                access = partial;
+        }
+    }
+    return access;
 }
 
 int
@@ -471,30 +437,36 @@ open_by_id(int mount_fd, const struct rbh_id *id, int flags)
     return fd;
 }
 
+int
+open_entry(int mount_fd, const struct rbh_id *id, bool io)
+{
+    int fd;
+
+    if (!io)
+        return open_by_id(mount_fd, id,
+                          O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_PATH);
+
+    /* O_NONBLOCK: do not hang on FIFOs */
+    fd = open_by_id(mount_fd, id,
+                    O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    if (fd < 0 && errno == ELOOP)
+        /* If the file to open is a symlink, reopen it with O_PATH set */
+        fd = open_by_id(mount_fd, id,
+                        O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_PATH);
+    return fd;
+}
+
 static int
-enrich_statx(struct rbh_statx *dest, const struct rbh_id *id, int mount_fd,
-             uint32_t mask, const struct rbh_statx *original)
+enrich_statx(struct rbh_statx *dest, int fd, uint32_t mask,
+             const struct rbh_statx *original)
 {
     static const int STATX_FLAGS = AT_STATX_FORCE_SYNC | AT_EMPTY_PATH
                                  | AT_NO_AUTOMOUNT | AT_SYMLINK_NOFOLLOW;
     struct rbh_statx statxbuf;
-    int save_errno;
-    int rc;
-    int fd;
-
-    fd = open_by_id(mount_fd, id, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_PATH);
-    if (fd == -1)
-        return -1;
 
     /* FIXME: We should really use AT_RBH_STATX_FORCE_SYNC here */
-    rc = rbh_statx(fd, "", STATX_FLAGS, mask, &statxbuf);
-    save_errno = errno;
-    /* Ignore errors on close */
-    close(fd);
-    if (rc == -1) {
-        errno = save_errno;
+    if (rbh_statx(fd, "", STATX_FLAGS, mask, &statxbuf))
         return -1;
-    }
 
     if (original) {
         *dest = *original;
@@ -520,20 +492,24 @@ exit_xattrs_values(void)
         rbh_sstack_destroy(xattrs_values);
 }
 
+void
+posix_enrich_reset(void)
+{
+    /* The stack is allocated again on demand */
+    exit_xattrs_values();
+    xattrs_values = NULL;
+}
+
 static int
 enrich_xattrs(const struct rbh_value *xattrs_to_enrich,
               struct rbh_value_pair **pairs, size_t *pair_count,
-              struct rbh_fsevent *enriched,
-              const struct rbh_id *id, int mount_fd)
+              struct rbh_fsevent *enriched, int fd)
 {
     char buffer[XATTR_VALUE_MAX_VFS_SIZE];
     const struct rbh_value *xattrs_seq;
     struct rbh_value *value;
     size_t xattrs_count;
     ssize_t length;
-    int save_errno;
-    int rc = 0;
-    int fd;
 
     if (xattrs_to_enrich->type != RBH_VT_SEQUENCE) {
         errno = EINVAL;
@@ -550,25 +526,12 @@ enrich_xattrs(const struct rbh_value *xattrs_to_enrich,
     xattrs_seq = xattrs_to_enrich->sequence.values;
     xattrs_count = xattrs_to_enrich->sequence.count;
 
-    fd = open_by_id(mount_fd, id, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
-    if (fd < 0 && errno == ELOOP)
-        /* If the file to open is a symlink, reopen it with O_PATH set */
-        fd = open_by_id(mount_fd, id, O_RDONLY | O_CLOEXEC | O_NOFOLLOW |
-                        O_PATH);
-
-    if (fd < 0) {
-        rc = -1;
-        goto err;
-    }
-
     if (enriched->xattrs.count + xattrs_count >= *pair_count) {
         void *tmp;
 
         tmp = reallocarray(*pairs, *pair_count + xattrs_count, sizeof(**pairs));
-        if (tmp == NULL) {
-            rc = -1;
-            goto err;
-        }
+        if (tmp == NULL)
+            return -1;
 
         *pairs = tmp;
         *pair_count = *pair_count + xattrs_count;
@@ -582,17 +545,13 @@ enrich_xattrs(const struct rbh_value *xattrs_to_enrich,
             value = NULL;
         } else {
             value = rbh_sstack_push(xattrs_values, NULL, sizeof(*value));
-            if (value == NULL) {
-                rc = -1;
-                goto err;
-            }
+            if (value == NULL)
+                return -1;
 
             value->type = RBH_VT_BINARY;
             value->binary.data = rbh_sstack_push(xattrs_values, buffer, length);
-            if (value->binary.data == NULL) {
-                rc = -1;
-                goto err;
-            }
+            if (value->binary.data == NULL)
+                return -1;
 
             value->binary.size = length;
         }
@@ -604,45 +563,30 @@ enrich_xattrs(const struct rbh_value *xattrs_to_enrich,
         enriched->xattrs.count++;
     }
 
-err:
-    save_errno = errno;
-    /* Ignore errors on close */
-    close(fd);
-    errno = save_errno;
-    return rc;
+    return 0;
 }
 
 /* The Linux VFS doesn't allow for symlinks of more than 64KiB */
 #define SYMLINK_MAX_SIZE (1 << 16)
 
 static int
-enrich_symlink(char symlink[SYMLINK_MAX_SIZE], const struct rbh_id *id,
-               int mount_fd)
+enrich_symlink(char symlink[SYMLINK_MAX_SIZE], int fd)
 {
-    int save_errno;
     ssize_t rc;
-    int fd;
-
-    fd = open_by_id(mount_fd, id, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_PATH);
-    if (fd == -1)
-        return -1;
 
     rc = readlinkat(fd, "", symlink, SYMLINK_MAX_SIZE - 1);
-    if (rc != -1)
-        symlink[rc] = 0;
+    if (rc == -1)
+        return -1;
 
-    save_errno = errno;
-    /* Ignore errors on close */
-    close(fd);
-    errno = save_errno;
-    return rc == -1 ? -1 : 0;
+    symlink[rc] = 0;
+    return 0;
 }
 
 int
 posix_enrich(const struct rbh_value_pair *partial,
              struct rbh_value_pair **pairs, size_t *pair_count,
              struct rbh_fsevent *enriched,
-             const struct rbh_fsevent *original, int mount_fd,
+             const struct rbh_fsevent *original, int fd,
              struct rbh_statx *statxbuf, char symlink[SYMLINK_MAX_SIZE])
 {
     uint32_t statx_mask;
@@ -659,8 +603,7 @@ posix_enrich(const struct rbh_value_pair *partial,
 
         if (parse_statx_mask(&statx_mask, partial->value))
             return -1;
-        if (enrich_statx(statxbuf, &original->id, mount_fd, statx_mask,
-                         original->upsert.statx))
+        if (enrich_statx(statxbuf, fd, statx_mask, original->upsert.statx))
             return -1;
 
         enriched->upsert.statx = statxbuf;
@@ -671,8 +614,7 @@ posix_enrich(const struct rbh_value_pair *partial,
             return -1;
         }
 
-        if (enrich_xattrs(partial->value, pairs, pair_count, enriched,
-                          &original->id, mount_fd))
+        if (enrich_xattrs(partial->value, pairs, pair_count, enriched, fd))
             return -1;
 
         break;
@@ -682,7 +624,7 @@ posix_enrich(const struct rbh_value_pair *partial,
             return -1;
         }
 
-        if (enrich_symlink(symlink, &original->id, mount_fd))
+        if (enrich_symlink(symlink, fd))
             return -1;
 
         enriched->upsert.symlink = symlink;
@@ -692,7 +634,7 @@ posix_enrich(const struct rbh_value_pair *partial,
 }
 
 static int
-enrich(struct enricher *enricher, const struct rbh_fsevent *original)
+_enrich(struct enricher *enricher, const struct rbh_fsevent *original, int fd)
 {
     struct rbh_fsevent *enriched = &enricher->fsevent;
     struct rbh_value_pair *pairs = enricher->pairs;
@@ -730,13 +672,15 @@ enrich(struct enricher *enricher, const struct rbh_fsevent *original)
 
         for (size_t i = 0; i < partials->count; i++) {
             if (posix_enrich(&partials->pairs[i], &pairs, &pair_count, enriched,
-                             original, enricher->mount_fd, &enricher->statx,
-                             enricher->symlink))
+                             original, fd, &enricher->statx, enricher->symlink))
                 return -1;
         }
 
     }
     enriched->xattrs.pairs = pairs;
+    /* Enriching xattrs may have reallocated pairs */
+    enricher->pairs = pairs;
+    enricher->pair_count = pair_count;
 
     return 0;
 }
@@ -744,17 +688,7 @@ enrich(struct enricher *enricher, const struct rbh_fsevent *original)
 static const void *
 posix_enricher_iter_next(void *iterator)
 {
-    struct enricher *enricher = iterator;
-    const void *fsevent;
-
-    fsevent = rbh_iter_next(enricher->fsevents);
-    if (fsevent == NULL)
-        return NULL;
-
-    if (enrich(enricher, fsevent))
-        return NULL;
-
-    return &enricher->fsevent;
+    return enricher_next(iterator, _enrich);
 }
 
 void
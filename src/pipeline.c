@@ -0,0 +1,582 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <robinhood/sstack.h>
+
+#include "pipeline.h"
+#include "ring.h"
+#include "utils.h"
+
+/* How many batches may wait between two stages of the pipeline */
+#define PIPELINE_DEPTH 2
+
+struct work {
+    struct rbh_iterator *fsevents;
+    /* Checkpoint of the source right after the batch was read */
+    uint64_t checkpoint;
+};
+
+/*----------------------------------------------------------------------------*
+ |                                 collection                                 |
+ *----------------------------------------------------------------------------*/
+
+/* Enrichers reuse the same memory for each fsevent they yield, the output of
+ * an enrichment stage needs to be copied before it is handed to the next
+ * stage.
+ */
+struct collection {
+    struct rbh_iterator iterator;
+
+    /* One stack per enrichment worker */
+    struct rbh_sstack **values;
+    size_t stack_count;
+
+    struct rbh_fsevent *fsevents;
+    size_t count;
+    size_t index;
+};
+
+static const void *
+collection_iter_next(void *iterator)
+{
+    struct collection *collection = iterator;
+
+    if (collection->index >= collection->count) {
+        errno = ENODATA;
+        return NULL;
+    }
+
+    return &collection->fsevents[collection->index++];
+}
+
+static void
+collection_iter_destroy(void *iterator)
+{
+    struct collection *collection = iterator;
+
+    for (size_t i = 0; i < collection->stack_count; i++)
+        rbh_sstack_destroy(collection->values[i]);
+    free(collection->values);
+    free(collection->fsevents);
+    free(collection);
+}
+
+static const struct rbh_iterator_operations COLLECTION_ITER_OPS = {
+    .next = collection_iter_next,
+    .destroy = collection_iter_destroy,
+};
+
+static const struct rbh_iterator COLLECTION_ITERATOR = {
+    .ops = &COLLECTION_ITER_OPS,
+};
+
+/*----------------------------------------------------------------------------*
+ |                                   stages                                   |
+ *----------------------------------------------------------------------------*/
+
+/* Returns NULL once the source is exhausted */
+static struct work *
+read_batch(struct pipeline *pipeline)
+{
+    struct rbh_iterator *fsevents;
+    struct work *work;
+
+    errno = 0;
+    fsevents = rbh_mut_iter_next(pipeline->batches);
+    if (fsevents == NULL) {
+        if (errno != ENODATA)
+            error(EXIT_FAILURE, errno, "getting the next batch of fsevents");
+        return NULL;
+    }
+
+    work = malloc(sizeof(*work));
+    if (work == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    work->fsevents = fsevents;
+    /* The source is left right after the last fsevent of the batch */
+    if (pipeline->checkpoint)
+        work->checkpoint = pipeline->checkpoint(pipeline->batches);
+    else
+        work->checkpoint = source_checkpoint(pipeline->source);
+    return work;
+}
+
+static void
+enrich_batch(struct pipeline *pipeline, struct work *work)
+{
+    struct rbh_iterator *fsevents = work->fsevents;
+
+    if (pipeline->builder != NULL)
+        fsevents = enrich_iter_builder_build_iter(pipeline->builder, fsevents);
+    else if (!pipeline->allow_partials)
+        fsevents = iter_no_partial(fsevents);
+
+    if (fsevents == NULL)
+        error(EXIT_FAILURE, errno, "iter_enrich");
+
+    work->fsevents = fsevents;
+}
+
+static void
+sink_batch(struct pipeline *pipeline, struct work *work)
+{
+    /* Enrichers already skip the fsevents of entries deleted in the meantime.
+     * Any error left means the sink stopped somewhere in the batch: the
+     * records of the batch must not be acknowledged then, or those past the
+     * error would be lost for good.
+     */
+    if (sink_process(pipeline->sink, work->fsevents))
+        error(EXIT_FAILURE, errno, "sink_process");
+
+    rbh_iter_destroy(work->fsevents);
+    /* Batches may have been enriched on the fly, on this thread */
+    enrich_reset();
+
+    if (source_acknowledge(pipeline->source, work->checkpoint))
+        error(EXIT_FAILURE, errno, "source_acknowledge");
+
+    if (pipeline->report)
+        pipeline->report();
+
+    free(work);
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  threads                                   |
+ *----------------------------------------------------------------------------*/
+
+/* Each stage pops batches from its input ring, and pushes them to its output
+ * ring. A NULL batch marks the end of the pipeline.
+ */
+struct stage {
+    struct pipeline *pipeline;
+    struct ring *input;
+    struct ring *output;
+    pthread_t thread;
+};
+
+static struct ring *
+pipeline_ring_new(void)
+{
+    struct ring *ring;
+
+    ring = ring_new(PIPELINE_DEPTH);
+    if (ring == NULL)
+        error(EXIT_FAILURE, errno, "ring_new");
+    return ring;
+}
+
+static void *
+read_stage(void *arg)
+{
+    struct stage *stage = arg;
+    struct work *work;
+
+    do {
+        work = read_batch(stage->pipeline);
+        ring_push(stage->output, work);
+    } while (work != NULL);
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*
+ |                              enrichment pool                               |
+ *----------------------------------------------------------------------------*/
+
+/* The fsevents of a batch are spread across enrichment workers according to
+ * the hash of their id: every fsevent of a given id is enriched by the same
+ * worker, in order. Enriched fsevents are then collected in the order of the
+ * batch.
+ */
+struct job {
+    const struct rbh_fsevent **fsevents;
+    struct rbh_fsevent *enriched;
+    /* Whether fsevents[i] was enriched or skipped */
+    bool *done;
+    size_t count;
+    size_t size;
+};
+
+/* The iterator of the fsevents a worker is responsible for */
+struct shard {
+    struct rbh_iterator iterator;
+
+    struct job *job;
+    size_t index;
+    size_t count;
+
+    size_t position;
+    /* Position of the last fsevent the shard yielded */
+    size_t last;
+};
+
+static const void *
+shard_iter_next(void *iterator)
+{
+    struct shard *shard = iterator;
+    struct job *job = shard->job;
+
+    while (shard->position < job->count) {
+        size_t position = shard->position++;
+
+        if (id_hash(&job->fsevents[position]->id) % shard->count
+                != shard->index)
+            continue;
+
+        shard->last = position;
+        return job->fsevents[position];
+    }
+
+    errno = ENODATA;
+    return NULL;
+}
+
+static void
+shard_iter_destroy(void *iterator)
+{
+    /* Shards are part of their worker */
+    (void)iterator;
+}
+
+static const struct rbh_iterator_operations SHARD_ITER_OPS = {
+    .next = shard_iter_next,
+    .destroy = shard_iter_destroy,
+};
+
+static const struct rbh_iterator SHARD_ITERATOR = {
+    .ops = &SHARD_ITER_OPS,
+};
+
+struct worker {
+    struct pipeline *pipeline;
+    struct shard shard;
+
+    struct ring *jobs;
+    struct ring *done;
+    /* Where the fsevents enriched by the worker are copied to, ownership of
+     * the stack is transferred to the collection of the batch.
+     */
+    struct rbh_sstack *values;
+    pthread_t thread;
+};
+
+static void
+worker_enrich(struct worker *worker, struct job *job)
+{
+    struct shard *shard = &worker->shard;
+    struct work work = {
+        .fsevents = &shard->iterator,
+    };
+    /* Position of the last fsevent enriched so far, if any */
+    size_t previous = SIZE_MAX;
+
+    worker->values = rbh_sstack_new(FSEVENT_COPY_CHUNK_SIZE);
+    if (worker->values == NULL)
+        error(EXIT_FAILURE, errno, "rbh_sstack_new");
+
+    shard->job = job;
+    shard->position = 0;
+
+    /* An enriched fsevent is stored at the position of the last fsevent the
+     * shard yielded. This relies on enrichers yielding at most one fsevent per
+     * fsevent they consume, and yielding it before they consume the next one:
+     * no enricher may read ahead of what it yields, nor reorder fsevents.
+     *
+     * Since the sink processes enriched fsevents in the order of the batch,
+     * the batch is only acknowledged once every shard is done with it.
+     */
+    enrich_batch(worker->pipeline, &work);
+    while (true) {
+        const struct rbh_fsevent *fsevent;
+
+        fsevent = rbh_iter_next(work.fsevents);
+        if (fsevent == NULL)
+            break;
+
+        if (previous != SIZE_MAX && shard->last <= previous)
+            error(EXIT_FAILURE, 0, "enricher yielded fsevents out of order");
+        previous = shard->last;
+        if (fsevent_copy(&job->enriched[shard->last], fsevent, worker->values))
+            error(EXIT_FAILURE, errno, "fsevent_copy");
+        job->done[shard->last] = true;
+    }
+
+    if (errno != ENODATA)
+        error(EXIT_FAILURE, errno, "enriching fsevents");
+
+    rbh_iter_destroy(work.fsevents);
+
+    /* Enriched fsevents were copied, what enrichers allocated for them on
+     * this thread can be reclaimed before the next batch.
+     */
+    enrich_reset();
+}
+
+static void *
+worker_routine(void *arg)
+{
+    struct worker *worker = arg;
+    struct job *job;
+
+    while ((job = ring_pop(worker->jobs)) != NULL) {
+        worker_enrich(worker, job);
+        ring_push(worker->done, job);
+    }
+
+    return NULL;
+}
+
+#define INITIAL_JOB_SIZE (1 << 7)
+
+struct enrichment {
+    struct stage stage;
+
+    struct job job;
+    struct worker *workers;
+    size_t worker_count;
+};
+
+static void
+job_add(struct job *job, const struct rbh_fsevent *fsevent)
+{
+    if (job->count == job->size) {
+        size_t size = job->size ? job->size << 1 : INITIAL_JOB_SIZE;
+        void *tmp;
+
+        tmp = reallocarray(job->fsevents, size, sizeof(*job->fsevents));
+        if (tmp == NULL)
+            error(EXIT_FAILURE, errno, "reallocarray");
+        job->fsevents = tmp;
+
+        tmp = reallocarray(job->enriched, size, sizeof(*job->enriched));
+        if (tmp == NULL)
+            error(EXIT_FAILURE, errno, "reallocarray");
+        job->enriched = tmp;
+
+        tmp = reallocarray(job->done, size, sizeof(*job->done));
+        if (tmp == NULL)
+            error(EXIT_FAILURE, errno, "reallocarray");
+        job->done = tmp;
+
+        job->size = size;
+    }
+
+    job->done[job->count] = false;
+    job->fsevents[job->count++] = fsevent;
+}
+
+/* Enrich the fsevents of \p fsevents on every worker, and destroy it */
+static struct rbh_iterator *
+enrichment_run(struct enrichment *enrichment, struct rbh_iterator *fsevents)
+{
+    struct collection *collection;
+    struct job *job = &enrichment->job;
+
+    /* Batches of the deduplicator yield fsevents which remain valid until the
+     * batch is destroyed.
+     */
+    job->count = 0;
+    while (true) {
+        const struct rbh_fsevent *fsevent;
+
+        fsevent = rbh_iter_next(fsevents);
+        if (fsevent == NULL)
+            break;
+
+        job_add(job, fsevent);
+    }
+
+    if (errno != ENODATA)
+        error(EXIT_FAILURE, errno, "reading a batch of fsevents");
+
+    /* The first worker is the thread of the enrichment stage itself */
+    for (size_t i = 1; i < enrichment->worker_count; i++)
+        ring_push(enrichment->workers[i].jobs, job);
+    worker_enrich(&enrichment->workers[0], job);
+    for (size_t i = 1; i < enrichment->worker_count; i++)
+        ring_pop(enrichment->workers[i].done);
+
+    collection = malloc(sizeof(*collection));
+    if (collection == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    collection->values = reallocarray(NULL, enrichment->worker_count,
+                                      sizeof(*collection->values));
+    if (collection->values == NULL)
+        error(EXIT_FAILURE, errno, "reallocarray");
+
+    for (size_t i = 0; i < enrichment->worker_count; i++)
+        collection->values[i] = enrichment->workers[i].values;
+    collection->stack_count = enrichment->worker_count;
+
+    collection->fsevents = reallocarray(NULL, job->count ? job->count : 1,
+                                        sizeof(*collection->fsevents));
+    if (collection->fsevents == NULL)
+        error(EXIT_FAILURE, errno, "reallocarray");
+
+    collection->count = 0;
+    for (size_t i = 0; i < job->count; i++) {
+        if (job->done[i])
+            collection->fsevents[collection->count++] = job->enriched[i];
+    }
+
+    collection->iterator = COLLECTION_ITERATOR;
+    collection->index = 0;
+
+    rbh_iter_destroy(fsevents);
+    return &collection->iterator;
+}
+
+static void *
+enrich_stage(void *arg)
+{
+    struct enrichment *enrichment = arg;
+    struct work *work;
+
+    do {
+        work = ring_pop(enrichment->stage.input);
+        if (work != NULL)
+            work->fsevents = enrichment_run(enrichment, work->fsevents);
+        ring_push(enrichment->stage.output, work);
+    } while (work != NULL);
+
+    return NULL;
+}
+
+static void
+enrichment_init(struct enrichment *enrichment, struct pipeline *pipeline,
+                size_t worker_count)
+{
+    enrichment->stage.pipeline = pipeline;
+    enrichment->job.fsevents = NULL;
+    enrichment->job.enriched = NULL;
+    enrichment->job.done = NULL;
+    enrichment->job.count = 0;
+    enrichment->job.size = 0;
+
+    enrichment->workers = reallocarray(NULL, worker_count,
+                                       sizeof(*enrichment->workers));
+    if (enrichment->workers == NULL)
+        error(EXIT_FAILURE, errno, "reallocarray");
+    enrichment->worker_count = worker_count;
+
+    for (size_t i = 0; i < worker_count; i++) {
+        struct worker *worker = &enrichment->workers[i];
+        int rc;
+
+        worker->pipeline = pipeline;
+        worker->shard.iterator = SHARD_ITERATOR;
+        worker->shard.index = i;
+        worker->shard.count = worker_count;
+        if (i == 0)
+            continue;
+
+        worker->jobs = pipeline_ring_new();
+        worker->done = pipeline_ring_new();
+        rc = pthread_create(&worker->thread, NULL, worker_routine, worker);
+        if (rc)
+            error(EXIT_FAILURE, rc, "pthread_create");
+    }
+}
+
+static void
+enrichment_fini(struct enrichment *enrichment)
+{
+    for (size_t i = 1; i < enrichment->worker_count; i++) {
+        struct worker *worker = &enrichment->workers[i];
+        int rc;
+
+        ring_push(worker->jobs, NULL);
+        rc = pthread_join(worker->thread, NULL);
+        if (rc)
+            error(EXIT_FAILURE, rc, "pthread_join");
+
+        ring_destroy(worker->jobs);
+        ring_destroy(worker->done);
+    }
+
+    free(enrichment->workers);
+    free(enrichment->job.fsevents);
+    free(enrichment->job.enriched);
+    free(enrichment->job.done);
+}
+
+static void
+stage_start(struct stage *stage, void *(*routine)(void *))
+{
+    int rc;
+
+    rc = pthread_create(&stage->thread, NULL, routine, stage);
+    if (rc)
+        error(EXIT_FAILURE, rc, "pthread_create");
+}
+
+static void
+stage_join(struct stage *stage)
+{
+    int rc;
+
+    rc = pthread_join(stage->thread, NULL);
+    if (rc)
+        error(EXIT_FAILURE, rc, "pthread_join");
+}
+
+void
+pipeline_run(struct pipeline *pipeline, unsigned int threads)
+{
+    struct stage reader = {
+        .pipeline = pipeline,
+    };
+    struct enrichment enrichment;
+    struct ring *input;
+    struct work *work;
+
+    if (threads <= 1) {
+        while ((work = read_batch(pipeline)) != NULL) {
+            enrich_batch(pipeline, work);
+            sink_batch(pipeline, work);
+        }
+        return;
+    }
+
+    reader.output = pipeline_ring_new();
+    stage_start(&reader, read_stage);
+    input = reader.output;
+
+    /* With only two threads, batches are enriched on the fly by the sink.
+     * Every thread but the reader's and the sink's enriches fsevents.
+     */
+    if (threads > 2) {
+        enrichment_init(&enrichment, pipeline, threads - 2);
+        enrichment.stage.input = reader.output;
+        enrichment.stage.output = pipeline_ring_new();
+        stage_start(&enrichment.stage, enrich_stage);
+        input = enrichment.stage.output;
+    }
+
+    while ((work = ring_pop(input)) != NULL) {
+        if (threads == 2)
+            enrich_batch(pipeline, work);
+        sink_batch(pipeline, work);
+    }
+
+    stage_join(&reader);
+    ring_destroy(reader.output);
+    if (threads > 2) {
+        stage_join(&enrichment.stage);
+        ring_destroy(enrichment.stage.output);
+        enrichment_fini(&enrichment);
+    }
+}
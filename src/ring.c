@@ -0,0 +1,119 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ring.h"
+
+#define CACHELINE_SIZE 64
+
+struct ring {
+    /* Index of the next slot to pop, only written by the consumer */
+    _Alignas(CACHELINE_SIZE) atomic_size_t head;
+    /* Index of the next slot to push, only written by the producer */
+    _Alignas(CACHELINE_SIZE) atomic_size_t tail;
+
+    _Alignas(CACHELINE_SIZE) size_t mask;
+    void *slots[];
+};
+
+struct ring *
+ring_new(size_t size)
+{
+    struct ring *ring;
+    size_t length;
+
+    if (size == 0 || size > (SIZE_MAX >> 1) / sizeof(*ring->slots)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    length = 1;
+    while (length < size)
+        length <<= 1;
+
+    size = sizeof(*ring) + length * sizeof(*ring->slots);
+    /* aligned_alloc() requires a multiple of the alignment */
+    size = (size + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1);
+
+    ring = aligned_alloc(CACHELINE_SIZE, size);
+    if (ring == NULL)
+        return NULL;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->mask = length - 1;
+    return ring;
+}
+
+/* Stages of the pipeline process whole batches, waiting on one another can
+ * take a while: spin a little, then yield the CPU, then sleep.
+ */
+static void
+ring_wait(unsigned int *attempts)
+{
+    static const struct timespec NAP = {
+        .tv_nsec = 100000, /* 100µs */
+    };
+
+    if (*attempts < 64)
+        atomic_signal_fence(memory_order_seq_cst);
+    else if (*attempts < 1024)
+        sched_yield();
+    else
+        nanosleep(&NAP, NULL);
+
+    if (*attempts < 1024)
+        (*attempts)++;
+}
+
+void
+ring_push(struct ring *ring, void *item)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int attempts = 0;
+
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire)
+            > ring->mask)
+        ring_wait(&attempts);
+
+    ring->slots[tail & ring->mask] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void *
+ring_pop(struct ring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int attempts = 0;
+    void *item;
+
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head)
+        ring_wait(&attempts);
+
+    item = ring->slots[head & ring->mask];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return item;
+}
+
+size_t
+ring_length(struct ring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+}
+
+void
+ring_destroy(struct ring *ring)
+{
+    free(ring);
+}
@@ -133,6 +133,15 @@ context_exit(void)
  |                               sized integers                               |
  *----------------------------------------------------------------------------*/
 
+/* Fields whose type is known in advance, like those of a struct statx, are
+ * emitted with the generic integer tag rather than a sized one.
+ */
+static bool
+integer_tag_match(const char *tag, const char *sized_tag)
+{
+    return strcmp(tag, sized_tag) == 0 || strcmp(tag, YAML_INT_TAG) == 0;
+}
+
     /*--------------------------------------------------------------------*
      |                              uint64_t                              |
      *--------------------------------------------------------------------*/
@@ -161,7 +170,8 @@ parse_uint64(const yaml_event_t *event, uint64_t *u)
 
     assert(event->type == YAML_SCALAR_EVENT);
 
-    if (tag ? strcmp(tag, UINT64_TAG) : !yaml_scalar_is_plain(event)) {
+    if (tag ? !integer_tag_match(tag, UINT64_TAG)
+            : !yaml_scalar_is_plain(event)) {
         errno = EINVAL;
         return false;
     }
@@ -236,7 +246,8 @@ parse_uint32(const yaml_event_t *event, uint32_t *u)
 
     assert(event->type == YAML_SCALAR_EVENT);
 
-    if (tag ? strcmp(tag, UINT32_TAG) : !yaml_scalar_is_plain(event)) {
+    if (tag ? !integer_tag_match(tag, UINT32_TAG)
+            : !yaml_scalar_is_plain(event)) {
         errno = EINVAL;
         return false;
     }
@@ -311,7 +322,8 @@ parse_int64(const yaml_event_t *event, int64_t *i)
 
     assert(event->type == YAML_SCALAR_EVENT);
 
-    if (tag ? strcmp(tag, INT64_TAG) : !yaml_scalar_is_plain(event)) {
+    if (tag ? !integer_tag_match(tag, INT64_TAG)
+            : !yaml_scalar_is_plain(event)) {
         errno = EINVAL;
         return false;
     }
@@ -510,26 +522,15 @@ parse_rbh_value_pair(yaml_parser_t *parser, yaml_event_t *event,
     return true;
 }
 
+/* Parse the pairs of a mapping whose start event was already consumed */
 static bool
-parse_rbh_value_map(yaml_parser_t *parser, struct rbh_value_map *map)
+parse_rbh_value_pairs(yaml_parser_t *parser, struct rbh_value_map *map)
 {
     struct rbh_value_pair *pairs;
-    yaml_event_t map_event;
     size_t count = 1; /* TODO: fine tune this */
     bool end = false;
     size_t i = 0;
 
-    if (!yaml_parser_parse(parser, &map_event))
-        parser_error(parser);
-
-    if (map_event.type != YAML_MAPPING_START_EVENT) {
-            yaml_event_delete(&map_event);
-            errno = EINVAL;
-            return false;
-    }
-
-    yaml_event_delete(&map_event);
-
     pairs = malloc(sizeof(*pairs) * count);
     if (pairs == NULL)
         return false;
@@ -595,6 +596,25 @@ parse_rbh_value_map(yaml_parser_t *parser, struct rbh_value_map *map)
     return true;
 }
 
+static bool
+parse_rbh_value_map(yaml_parser_t *parser, struct rbh_value_map *map)
+{
+    yaml_event_t map_event;
+
+    if (!yaml_parser_parse(parser, &map_event))
+        parser_error(parser);
+
+    if (map_event.type != YAML_MAPPING_START_EVENT) {
+            yaml_event_delete(&map_event);
+            errno = EINVAL;
+            return false;
+    }
+
+    yaml_event_delete(&map_event);
+
+    return parse_rbh_value_pairs(parser, map);
+}
+
     /*--------------------------------------------------------------------*
      |                              sequence                              |
      *--------------------------------------------------------------------*/
@@ -964,7 +984,7 @@ parse_rbh_value(yaml_parser_t *parser, yaml_event_t *event,
         return parse_sequence(parser, value);
     case RBH_VT_MAP:
         yaml_event_delete(event);
-        return parse_rbh_value_map(parser, &value->map);
+        return parse_rbh_value_pairs(parser, &value->map);
     }
 
     yaml_event_delete(event);
@@ -989,18 +1009,6 @@ save_event:
 static bool
 parse_xattrs(yaml_parser_t *parser, struct rbh_value_map *map)
 {
-    yaml_event_t event;
-
-    if (!yaml_parser_parse(parser, &event))
-        parser_error(parser);
-
-    if (event.type != YAML_MAPPING_START_EVENT) {
-        yaml_event_delete(&event);
-        errno = EINVAL;
-        return false;
-    }
-    yaml_event_delete(&event);
-
     return parse_rbh_value_map(parser, map);
 }
 
@@ -1926,7 +1934,8 @@ str2statx_field(const char *string)
 static bool
 parse_statx_mapping(yaml_parser_t *parser, struct rbh_statx *statxbuf)
 {
-    statxbuf->stx_mode = 0;
+    /* statxbuf is reused from one upsert to the next */
+    memset(statxbuf, 0, sizeof(*statxbuf));
 
     while (true) {
         enum statx_field field;
@@ -36,7 +36,14 @@ file_sink_process(void *_sink, struct rbh_iterator *fsevents)
             return -1;
     }
 
-    return errno == ENODATA ? 0 : -1;
+    if (errno != ENODATA)
+        return -1;
+
+    /* The source may acknowledge the fsevents once this returns */
+    if (!yaml_emitter_flush(&sink->emitter) || fflush(sink->file))
+        return -1;
+
+    return 0;
 }
 
 static void
@@ -13,7 +13,9 @@
 #include <robinhood/fsevent.h>
 
 #include "include/serialization.h"
+#include "arena.h"
 #include "source.h"
+#include "utils.h"
 
 struct yaml_fsevent_iterator {
     struct rbh_iterator iterator;
@@ -21,6 +23,13 @@ struct yaml_fsevent_iterator {
     struct rbh_fsevent fsevent;
     yaml_parser_t parser;
     bool exhausted;
+
+    /* parse_fsevent() only keeps an fsevent until the next one is parsed,
+     * fsevents are copied here until they are acknowledged.
+     */
+    struct arena *arena;
+    /* Number of fsevents yielded so far */
+    uint64_t count;
 };
 
 static void __attribute__((noreturn))
@@ -34,6 +43,7 @@ static const void *
 yaml_fsevent_iter_next(void *iterator)
 {
     struct yaml_fsevent_iterator *fsevents = iterator;
+    struct rbh_fsevent fsevent;
     yaml_event_type_t type;
     yaml_event_t event;
 
@@ -51,9 +61,9 @@ yaml_fsevent_iter_next(void *iterator)
     switch (type) {
     case YAML_DOCUMENT_START_EVENT:
         /* Remove any trace of the previous parsed fsevent */
-        memset(&fsevents->fsevent, 0, sizeof(fsevents->fsevent));
+        memset(&fsevent, 0, sizeof(fsevent));
 
-        if (!parse_fsevent(&fsevents->parser, &fsevents->fsevent))
+        if (!parse_fsevent(&fsevents->parser, &fsevent))
             parser_error(&fsevents->parser);
 
         if (!yaml_parser_parse(&fsevents->parser, &event))
@@ -61,6 +71,11 @@ yaml_fsevent_iter_next(void *iterator)
 
         assert(event.type == YAML_DOCUMENT_END_EVENT);
         yaml_event_delete(&event);
+
+        fsevents->count++;
+        if (fsevent_copy(&fsevents->fsevent, &fsevent,
+                         arena_values(fsevents->arena, fsevents->count)))
+            return NULL;
         return &fsevents->fsevent;
     case YAML_STREAM_END_EVENT:
         fsevents->exhausted = true;
@@ -78,6 +93,7 @@ yaml_fsevent_iter_destroy(void *iterator)
     struct yaml_fsevent_iterator *fsevents = iterator;
 
     yaml_parser_delete(&fsevents->parser);
+    arena_destroy(fsevents->arena);
 }
 
 static const struct rbh_iterator_operations YAML_FSEVENT_ITER_OPS = {
@@ -106,9 +122,14 @@ yaml_fsevent_init(struct yaml_fsevent_iterator *fsevents, FILE *file)
     assert(event.type == YAML_STREAM_START_EVENT);
     yaml_event_delete(&event);
 
+    fsevents->arena = arena_new(FSEVENT_COPY_CHUNK_SIZE);
+    if (fsevents->arena == NULL)
+        error(EXIT_FAILURE, errno, "arena_new");
+
     fsevents->iterator = YAML_FSEVENT_ITERATOR;
     fsevents->exhausted = false;
     fsevents->fsevent.type = 0;
+    fsevents->count = 0;
 }
 
 struct file_source {
@@ -142,11 +163,35 @@ static const struct rbh_iterator_operations SOURCE_ITER_OPS = {
     .destroy = source_iter_destroy,
 };
 
+static uint64_t
+file_source_checkpoint(void *_source)
+{
+    struct file_source *source = _source;
+
+    return source->fsevents.count;
+}
+
+static int
+file_source_acknowledge(void *_source, uint64_t checkpoint)
+{
+    struct file_source *source = _source;
+
+    arena_release(source->fsevents.arena, checkpoint);
+    return 0;
+}
+
+static const struct source_operations FILE_SOURCE_OPS = {
+    .checkpoint = file_source_checkpoint,
+    .acknowledge = file_source_acknowledge,
+};
+
 static const struct source FILE_SOURCE = {
     .name = "file",
     .fsevents = {
         .ops = &SOURCE_ITER_OPS,
     },
+    .ops = &FILE_SOURCE_OPS,
+    .retains = true,
 };
 
 struct source *
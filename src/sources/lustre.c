@@ -7,8 +7,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <error.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <sysexits.h>
+#include <time.h>
 
 #include <lustre/lustreapi.h>
 
@@ -16,51 +22,98 @@
 #include <robinhood/sstack.h>
 #include <robinhood/statx.h>
 
+#include "arena.h"
+#include "ring.h"
 #include "source.h"
+#include "utils.h"
 
-static __thread struct rbh_sstack *_values;
+/* The source is only ever read from one thread at a time, but not
+ * necessarily the one that created it.
+ *
+ * Stack of the region of the arena the fsevents of the current record are
+ * allocated in.
+ */
+static struct rbh_sstack *_values;
 
-static void
-_values_flush(struct rbh_sstack *values)
-{
-    while (true) {
-        size_t readable;
+struct prefetcher {
+    struct ring *records;
+    struct prefetch_options options;
+    /* What made the prefetcher stop: the return value of the last call to
+     * llapi_changelog_recv(), set before END is pushed.
+     */
+    int rc;
+    /* Set by the consumer when it will not read records anymore */
+    atomic_bool stop;
+    /* Whether the consumer popped END */
+    bool ended;
 
-        rbh_sstack_peek(values, &readable);
-        if (readable == 0)
-            break;
+    /* Either end of the ring sleeps on cond once it has spun long enough,
+     * the other end only signals it if it is asleep.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_bool producer_asleep;
+    atomic_bool consumer_asleep;
+    pthread_t thread;
+};
 
-        rbh_sstack_pop(values, readable);
-    }
-    rbh_sstack_shrink(values);
-}
+#define RECORD_TYPE(type) (UINT64_C(1) << (type))
+
+/* Types of the records fsevents are built for, the others are skipped */
+#define RECORD_TYPES_SUPPORTED ( \
+    RECORD_TYPE(CL_CREATE) | RECORD_TYPE(CL_MKDIR) | \
+    RECORD_TYPE(CL_HARDLINK) | RECORD_TYPE(CL_SOFTLINK) | \
+    RECORD_TYPE(CL_MKNOD) | RECORD_TYPE(CL_UNLINK) | RECORD_TYPE(CL_RMDIR) | \
+    RECORD_TYPE(CL_RENAME) | RECORD_TYPE(CL_CLOSE) | RECORD_TYPE(CL_LAYOUT) | \
+    RECORD_TYPE(CL_TRUNC) | RECORD_TYPE(CL_SETATTR) | \
+    RECORD_TYPE(CL_SETXATTR) | RECORD_TYPE(CL_HSM) | RECORD_TYPE(CL_MTIME) | \
+    RECORD_TYPE(CL_CTIME) | RECORD_TYPE(CL_ATIME) | RECORD_TYPE(CL_MIGRATE) | \
+    RECORD_TYPE(CL_FLRW) | RECORD_TYPE(CL_RESYNC))
+
+/* Types of the records whose fsevents need the uid and gid of the entry */
+#define RECORD_TYPES_UIDGID ( \
+    RECORD_TYPE(CL_CREATE) | RECORD_TYPE(CL_MKDIR) | \
+    RECORD_TYPE(CL_HARDLINK) | RECORD_TYPE(CL_SOFTLINK) | \
+    RECORD_TYPE(CL_MKNOD) | RECORD_TYPE(CL_RENAME) | RECORD_TYPE(CL_MIGRATE))
+
+/* CL_RENAME and CL_MIGRATE records expand into the most fsevents */
+#define MAX_RECORD_FSEVENTS 6
+
+/* The fsevents a changelog record expands into
+ *
+ * A record is expanded all at once: the ids its fsevents share are built only
+ * once, and what they point to stays valid until the record is acknowledged.
+ */
+struct expansion {
+    struct rbh_fsevent fsevents[MAX_RECORD_FSEVENTS];
+    size_t count;
+    /* What new fsevents are about, the target of the record by default */
+    const struct rbh_id *id;
+};
 
 struct lustre_changelog_iterator {
     struct rbh_iterator iterator;
 
     void *reader;
-    struct changelog_rec *prev_record;
-    unsigned int process_step;
+    /* NULL if records are read on demand */
+    struct prefetcher *prefetcher;
+    /* Types of the records to process, as a mask of RECORD_TYPE() bits */
+    uint64_t types;
+    /* Where fsevents are allocated, until they are acknowledged */
+    struct arena *arena;
+    struct expansion expansion;
+    /* Index of the next fsevent of expansion to yield */
+    size_t position;
+    /* Record received but not consumed yet, NULL if there is none */
+    struct changelog_rec *next_record;
+
+    /* cr_time of the last record received from the changelog */
+    __u64 time;
+    /* cr_index of the first and last records expansion stems from */
+    __u64 first_index;
+    __u64 index;
 };
 
-static void *
-fsevent_from_record(struct changelog_rec *record)
-{
-    struct rbh_fsevent *bad;
-
-    (void)record;
-
-    bad = malloc(sizeof(*bad));
-    if (bad == NULL)
-        return NULL;
-
-    bad->type = -1;
-    bad->id.data = NULL;
-    bad->id.size = 0;
-
-    return bad;
-}
-
 /* BSON results:
  * { "statx" : { "uid" : x, "gid" : y } }
  */
@@ -361,8 +414,23 @@ build_statx_event(uint32_t statx_enrich_mask, struct rbh_fsevent *fsevent,
     return 0;
 }
 
+/* Append a new fsevent to \p expansion, about the target of the record */
+static struct rbh_fsevent *
+expansion_push(struct expansion *expansion)
+{
+    struct rbh_fsevent *fsevent;
+
+    assert(expansion->count < MAX_RECORD_FSEVENTS);
+    fsevent = &expansion->fsevents[expansion->count++];
+    memset(fsevent, 0, sizeof(*fsevent));
+    fsevent->id = *expansion->id;
+
+    return fsevent;
+}
+
 static int
-new_link_inode_event(struct changelog_rec *record, struct rbh_fsevent *fsevent)
+new_link_inode_event(struct changelog_rec *record, const struct rbh_id *parent,
+                     struct rbh_fsevent *fsevent)
 {
     char *data;
 
@@ -372,9 +440,7 @@ new_link_inode_event(struct changelog_rec *record, struct rbh_fsevent *fsevent)
     if (fsevent->xattrs.pairs == NULL)
         return -1;
 
-    fsevent->link.parent_id = build_id(&record->cr_pfid);
-    if (fsevent->link.parent_id == NULL)
-        return -1;
+    fsevent->link.parent_id = parent;
 
     data = rbh_sstack_push(_values, NULL, record->cr_namelen + 1);
     if (data == NULL)
@@ -404,18 +470,12 @@ update_statx_without_uid_gid_event(struct changelog_rec *record,
 }
 
 static int
-update_parent_acmtime_event(struct lu_fid *parent_id,
+update_parent_acmtime_event(const struct rbh_id *parent,
                             struct rbh_fsevent *fsevent)
 {
     uint32_t statx_enrich_mask;
-    struct rbh_id *id;
 
-    id = build_id(parent_id);
-    if (id == NULL)
-        return -1;
-
-    fsevent->id.data = id->data;
-    fsevent->id.size = id->size;
+    fsevent->id = *parent;
 
     statx_enrich_mask = RBH_STATX_ATIME | RBH_STATX_CTIME | RBH_STATX_MTIME;
     if (build_statx_event(statx_enrich_mask, fsevent, NULL))
@@ -424,124 +484,120 @@ update_parent_acmtime_event(struct lu_fid *parent_id,
     return 0;
 }
 
+/* Mark an fsevent for Lustre enrichment to retrieve all Lustre values */
 static int
-build_create_inode_events(unsigned int process_step,
-                          struct changelog_rec *record,
-                          struct rbh_fsevent *fsevent)
+build_lustre_xattrs_event(struct rbh_fsevent *fsevent)
 {
-    assert(process_step < 4);
-    switch(process_step) {
-    case 0:
-        if (new_link_inode_event(record, fsevent))
-            return -1;
+    fsevent->type = RBH_FET_XATTR;
 
-        break;
-    case 1:
-        fsevent->type = RBH_FET_XATTR;
+    return build_enrich_xattr_fsevent(&fsevent->xattrs,
+                                      "rbh-fsevents",
+                                      build_empty_map("lustre"),
+                                      NULL);
+}
 
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "fid",
-                                       fill_ns_xattrs_fid(record),
-                                       "rbh-fsevents",
-                                       build_empty_map("lustre"),
-                                       NULL))
-            return -1;
+static int
+build_create_inode_events(struct changelog_rec *record,
+                          struct expansion *expansion)
+{
+    struct rbh_fsevent *fsevent;
+    struct rbh_id *parent;
 
-        break;
-    case 2:
-        if (update_statx_without_uid_gid_event(record, fsevent))
-            return -1;
+    parent = build_id(&record->cr_pfid);
+    if (parent == NULL)
+        return -1;
 
-        break;
-    case 3: /* Update the parent information after creating a new entry */
-        if (update_parent_acmtime_event(&record->cr_pfid, fsevent))
-            return -1;
+    if (new_link_inode_event(record, parent, expansion_push(expansion)))
+        return -1;
 
-        break;
-    }
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_XATTR;
+    if (build_enrich_xattr_fsevent(&fsevent->xattrs,
+                                   "fid",
+                                   fill_ns_xattrs_fid(record),
+                                   "rbh-fsevents",
+                                   build_empty_map("lustre"),
+                                   NULL))
+        return -1;
+
+    if (update_statx_without_uid_gid_event(record, expansion_push(expansion)))
+        return -1;
 
-    return process_step != 3 ? 1 : 0;
+    /* Update the parent information after creating a new entry */
+    return update_parent_acmtime_event(parent, expansion_push(expansion));
 }
 
 static int
-build_setxattr_event(unsigned int process_step, struct changelog_rec *record,
-                     struct rbh_fsevent *fsevent)
+build_setxattr_event(struct changelog_rec *record, struct expansion *expansion)
 {
     char *xattr = changelog_rec_xattr(record)->cr_xattr;
     uint32_t statx_enrich_mask = 0;
+    struct rbh_fsevent *fsevent;
 
-    assert(process_step < 2);
-    switch(process_step) {
-    case 0:
-        fsevent->type = RBH_FET_UPSERT;
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_UPSERT;
 
-        statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC;
-        fsevent->xattrs = build_enrich_map(fill_statx, &statx_enrich_mask);
-        if (fsevent->xattrs.pairs == NULL)
-            return -1;
+    statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC;
+    fsevent->xattrs = build_enrich_map(fill_statx, &statx_enrich_mask);
+    if (fsevent->xattrs.pairs == NULL)
+        return -1;
 
-        return 1;
-    case 1:
-        fsevent->type = RBH_FET_XATTR;
-        fsevent->xattrs = build_enrich_map(fill_inode_xattrs, xattr);
-        if (fsevent->xattrs.pairs == NULL)
-            return -1;
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_XATTR;
+    fsevent->xattrs = build_enrich_map(fill_inode_xattrs, xattr);
+    if (fsevent->xattrs.pairs == NULL)
+        return -1;
 
-        return 0;
-    }
-    __builtin_unreachable();
+    return 0;
 }
 
 static int
-build_softlink_events(unsigned int process_step, struct changelog_rec *record,
-                      struct rbh_fsevent *fsevent)
+build_softlink_events(struct changelog_rec *record, struct expansion *expansion)
 {
-    assert(process_step < 5);
+    struct rbh_fsevent *fsevent;
+    struct rbh_id *parent;
+
     /* Do the exact same operations as for creating an inode, except for an
      * additional one that is the enrichment of the symlink target
      */
-    switch(process_step) {
-    case 0:
-        if (new_link_inode_event(record, fsevent))
-            return -1;
+    parent = build_id(&record->cr_pfid);
+    if (parent == NULL)
+        return -1;
 
-        break;
-    case 1:
-        fsevent->type = RBH_FET_XATTR;
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "fid", fill_ns_xattrs_fid(record),
-                                       NULL))
+    if (new_link_inode_event(record, parent, expansion_push(expansion)))
         return -1;
 
-        break;
-    case 2:
-        if (update_statx_without_uid_gid_event(record, fsevent))
-            return -1;
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_XATTR;
+    if (build_enrich_xattr_fsevent(&fsevent->xattrs,
+                                   "fid", fill_ns_xattrs_fid(record),
+                                   NULL))
+        return -1;
 
-        break;
-    case 3:
-        if (update_parent_acmtime_event(&record->cr_pfid, fsevent))
-            return -1;
+    if (update_statx_without_uid_gid_event(record, expansion_push(expansion)))
+        return -1;
 
-        break;
-    case 4: /* Mark the event for enrichment of the symlink target */
-        fsevent->type = RBH_FET_UPSERT;
-        fsevent->upsert.statx = NULL;
+    if (update_parent_acmtime_event(parent, expansion_push(expansion)))
+        return -1;
 
-        fsevent->xattrs = build_enrich_map(build_symlink_enrich_map, NULL);
-        if (fsevent->xattrs.pairs == NULL)
-            return -1;
-    }
+    /* Mark the event for enrichment of the symlink target */
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_UPSERT;
+    fsevent->upsert.statx = NULL;
+
+    fsevent->xattrs = build_enrich_map(build_symlink_enrich_map, NULL);
+    if (fsevent->xattrs.pairs == NULL)
+        return -1;
 
-    return process_step != 4 ? 1 : 0;
+    return 0;
 }
 
 static int
-build_hardlink_or_mknod_events(unsigned int process_step,
-                               struct changelog_rec *record,
-                               struct rbh_fsevent *fsevent)
+build_hardlink_or_mknod_events(struct changelog_rec *record,
+                               struct expansion *expansion)
 {
-    assert(process_step < 4);
+    struct rbh_id *parent;
+
     /* For hardlinks, we must create a new ns entry for the target, update its
      * statx attributes and the statx attributes of the parent directory of the
      * link. We don't need to retrieve the xattrs of the link, since they are
@@ -553,39 +609,27 @@ build_hardlink_or_mknod_events(unsigned int process_step,
      * Therefore, the build of a hardlink or mknod event is subset of the
      * operations done to build a inode creation event.
      */
-    switch(process_step) {
-    case 0: /* Create new ns entry for the target */
-        if (new_link_inode_event(record, fsevent))
-            return -1;
-
-        break;
-    case 1: /* update target statx */
-        if (update_statx_without_uid_gid_event(record, fsevent))
-            return -1;
-
-        break;
-    case 2: /* update link's parent statx */
-        if (update_parent_acmtime_event(&record->cr_pfid, fsevent))
-            return -1;
+    parent = build_id(&record->cr_pfid);
+    if (parent == NULL)
+        return -1;
 
-        break;
-    case 3:
-        fsevent->type = RBH_FET_XATTR;
+    /* Create new ns entry for the target */
+    if (new_link_inode_event(record, parent, expansion_push(expansion)))
+        return -1;
 
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "rbh-fsevents",
-                                       build_empty_map("lustre"),
-                                       NULL))
-            return -1;
+    /* update target statx */
+    if (update_statx_without_uid_gid_event(record, expansion_push(expansion)))
+        return -1;
 
-        break;
-    }
+    /* update link's parent statx */
+    if (update_parent_acmtime_event(parent, expansion_push(expansion)))
+        return -1;
 
-    return process_step != 3 ? 1 : 0;
+    return build_lustre_xattrs_event(expansion_push(expansion));
 }
 
 static int
-unlink_inode_event(struct lu_fid *parent_id, char *name, size_t namelen,
+unlink_inode_event(const struct rbh_id *parent, char *name, size_t namelen,
                    bool last_copy, struct rbh_fsevent *fsevent)
 {
     char *data;
@@ -602,9 +646,7 @@ unlink_inode_event(struct lu_fid *parent_id, char *name, size_t namelen,
 
     fsevent->type = RBH_FET_UNLINK;
 
-    fsevent->link.parent_id = build_id(parent_id);
-    if (fsevent->link.parent_id == NULL)
-        return -1;
+    fsevent->link.parent_id = parent;
 
     data = rbh_sstack_push(_values, NULL, namelen + 1);
     if (data == NULL)
@@ -617,27 +659,24 @@ unlink_inode_event(struct lu_fid *parent_id, char *name, size_t namelen,
 }
 
 static int
-build_unlink_or_rmdir_events(unsigned int process_step,
-                             struct changelog_rec *record,
-                             struct rbh_fsevent *fsevent)
+build_unlink_or_rmdir_events(struct changelog_rec *record,
+                             struct expansion *expansion)
 {
     bool last_copy = (record->cr_flags & CLF_UNLINK_LAST) &&
                      !(record->cr_flags & CLF_UNLINK_HSM_EXISTS);
+    struct rbh_id *parent;
 
-    assert(process_step < 2);
-    switch(process_step) {
-    case 0:
-        if (unlink_inode_event(&record->cr_pfid, changelog_rec_name(record),
-                               record->cr_namelen, last_copy, fsevent))
-            return -1;
+    parent = build_id(&record->cr_pfid);
+    if (parent == NULL)
+        return -1;
 
-        break;
-    case 1: /* update parent statx */
-        if (update_parent_acmtime_event(&record->cr_pfid, fsevent))
-            return -1;
-    }
+    if (unlink_inode_event(parent, changelog_rec_name(record),
+                           record->cr_namelen, last_copy,
+                           expansion_push(expansion)))
+        return -1;
 
-    return process_step != 1 ? 1 : 0;
+    /* update parent statx */
+    return update_parent_acmtime_event(parent, expansion_push(expansion));
 }
 
 /* Renames are a combination of 6 values :
@@ -654,80 +693,61 @@ build_unlink_or_rmdir_events(unsigned int process_step,
  * that means data was overwriten.
  */
 static int
-build_rename_events(unsigned int process_step, struct changelog_rec *record,
-                    struct rbh_fsevent *fsevent)
+build_rename_events(struct changelog_rec *record, struct expansion *expansion)
 {
     struct changelog_ext_rename *rename_log = changelog_rec_rename(record);
     /* If the overwriten link is the last one and it has no HSM copy */
     bool last_copy = (record->cr_flags & CLF_RENAME_LAST) &&
                      !(record->cr_flags & CLF_RENAME_LAST_EXISTS);
+    struct rbh_id *source_parent;
+    struct rbh_id *parent;
     struct rbh_id *id;
 
-    /* Unlink of the overwriten link is the first step done, but if the target
-     * fid is 0, we can skip that step instead. To prevent any NULL fsevents
-     * issue, we simply increment the process_step and manage the rest
-     * of the event normally.
-     */
-    if (fid_is_zero(&record->cr_tfid))
-        process_step += 1;
+    parent = build_id(&record->cr_pfid);
+    if (parent == NULL)
+        return -1;
 
-    /* If a file was overwritten, id is cr_tfid which is the FID of the file
-     * that was removed. We need to remove that entry from the backend, so we
-     * do not change id. If process step is greater than 0, we need to target
-     * the file that was renamed which is cr_sfid, so we replace id here.
+    /* If a file was overwritten, cr_tfid is the FID of the file that was
+     * removed: we need to remove that entry from the backend first.
      */
-    if (process_step != 0) {
-        /* XXX: the build here could be done only once and reused for the rest
-         * of the event, but I couldn't find a proper way to do it, and by using
-         * a static variable, I couldn't make the unlink of the source work...
-         */
-        id = build_id(&rename_log->cr_sfid);
-        if (id == NULL)
+    if (!fid_is_zero(&record->cr_tfid)) {
+        if (unlink_inode_event(parent, changelog_rec_name(record),
+                               record->cr_namelen, last_copy,
+                               expansion_push(expansion)))
             return -1;
-
-        fsevent->id.data = id->data;
-        fsevent->id.size = id->size;
     }
 
-    assert(process_step < 6);
-    switch (process_step) {
-    case 0: /* unlink overwriten inode */
-        if (unlink_inode_event(&record->cr_pfid, changelog_rec_name(record),
-                               record->cr_namelen, last_copy, fsevent))
-            return -1;
-
-        break;
-    case 1: /* create new link */
-        if (new_link_inode_event(record, fsevent))
-            return -1;
+    /* Every other fsevent targets the file that was renamed, cr_sfid */
+    id = build_id(&rename_log->cr_sfid);
+    if (id == NULL)
+        return -1;
+    expansion->id = id;
 
-        break;
-    case 2: /* update target statx */
-        if (update_statx_without_uid_gid_event(record, fsevent))
-            return -1;
+    source_parent = build_id(&rename_log->cr_spfid);
+    if (source_parent == NULL)
+        return -1;
 
-        break;
-    case 3: /* update target's parent statx */
-        if (update_parent_acmtime_event(&record->cr_pfid, fsevent))
-            return -1;
+    /* create new link */
+    if (new_link_inode_event(record, parent, expansion_push(expansion)))
+        return -1;
 
-        break;
-    case 4: /* unlink source link */
-        if (unlink_inode_event(&rename_log->cr_spfid,
-                               changelog_rec_sname(record),
-                               changelog_rec_snamelen(record),
-                               false, fsevent))
-            return -1;
+    /* update target statx */
+    if (update_statx_without_uid_gid_event(record, expansion_push(expansion)))
+        return -1;
 
-        break;
-    case 5: /* update source's parent statx */
-        if (update_parent_acmtime_event(&rename_log->cr_spfid, fsevent))
-            return -1;
+    /* update target's parent statx */
+    if (update_parent_acmtime_event(parent, expansion_push(expansion)))
+        return -1;
 
-        break;
-    }
+    /* unlink source link */
+    if (unlink_inode_event(source_parent, changelog_rec_sname(record),
+                           changelog_rec_snamelen(record), false,
+                           expansion_push(expansion)))
+        return -1;
 
-    return process_step != 5 ? 1 : 0;
+    /* update source's parent statx */
+    return update_parent_acmtime_event(source_parent,
+                                       expansion_push(expansion));
 }
 
 /* In the future we will need to modify this function to create two events for
@@ -737,89 +757,60 @@ build_rename_events(unsigned int process_step, struct changelog_rec *record,
  * associated function.
  */
 static int
-build_hsm_events(unsigned int process_step, struct rbh_fsevent *fsevent)
+build_hsm_events(struct expansion *expansion)
 {
     uint32_t statx_enrich_mask = 0;
+    struct rbh_fsevent *fsevent;
 
-    assert(process_step < 4);
-    switch(process_step) {
-    case 0:
-        fsevent->type = RBH_FET_UPSERT;
-
-        statx_enrich_mask = RBH_STATX_BLOCKS;
-        fsevent->xattrs = build_enrich_map(fill_statx, &statx_enrich_mask);
-        if (fsevent->xattrs.pairs == NULL)
-            return -1;
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_UPSERT;
 
-        break;
-    case 1:
-        fsevent->type = RBH_FET_XATTR;
-
-        /* Mark this fsevent for Lustre enrichment to retrieve all Lustre
-         * values. Will be changed later to retrieve only the modified values,
-         * i.e. archive id, hsm state and layout.
-         */
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "rbh-fsevents",
-                                       build_empty_map("lustre"),
-                                       NULL))
-            return -1;
+    statx_enrich_mask = RBH_STATX_BLOCKS;
+    fsevent->xattrs = build_enrich_map(fill_statx, &statx_enrich_mask);
+    if (fsevent->xattrs.pairs == NULL)
+        return -1;
 
-        break;
-    case 2:
-        fsevent->type = RBH_FET_XATTR;
+    /* Will be changed later to retrieve only the modified values,
+     * i.e. archive id, hsm state and layout.
+     */
+    if (build_lustre_xattrs_event(expansion_push(expansion)))
+        return -1;
 
-        fsevent->xattrs = build_enrich_map(fill_inode_xattrs, "trusted.lov");
-        if (fsevent->xattrs.pairs == NULL)
-            return -1;
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_XATTR;
 
-        break;
-    case 3:
-        fsevent->type = RBH_FET_XATTR;
+    fsevent->xattrs = build_enrich_map(fill_inode_xattrs, "trusted.lov");
+    if (fsevent->xattrs.pairs == NULL)
+        return -1;
 
-        fsevent->xattrs = build_enrich_map(fill_inode_xattrs, "trusted.hsm");
-        if (fsevent->xattrs.pairs == NULL)
-            return -1;
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_XATTR;
 
-        break;
-    }
+    fsevent->xattrs = build_enrich_map(fill_inode_xattrs, "trusted.hsm");
+    if (fsevent->xattrs.pairs == NULL)
+        return -1;
 
-    return process_step != 3 ? 1 : 0;
+    return 0;
 }
 
 static int
-build_layout_events(unsigned int process_step, struct rbh_fsevent *fsevent)
+build_layout_events(struct expansion *expansion)
 {
     uint32_t statx_enrich_mask = 0;
+    struct rbh_fsevent *fsevent;
 
-    assert(process_step < 2);
-    switch(process_step) {
-    case 0:
-        fsevent->type = RBH_FET_UPSERT;
-
-        statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC;
-        fsevent->xattrs = build_enrich_map(fill_statx, &statx_enrich_mask);
-        if (fsevent->xattrs.pairs == NULL)
-            return -1;
-
-        return 1;
-    case 1:
-        fsevent->type = RBH_FET_XATTR;
-
-        /* Mark this fsevent for Lustre enrichment to retrieve all Lustre
-         * values. Will be changed later to retrieve only the modified values,
-         * i.e. trusted.lov.
-         */
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "rbh-fsevents",
-                                       build_empty_map("lustre"),
-                                       NULL))
-            return -1;
+    fsevent = expansion_push(expansion);
+    fsevent->type = RBH_FET_UPSERT;
 
-        break;
-    }
+    statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC;
+    fsevent->xattrs = build_enrich_map(fill_statx, &statx_enrich_mask);
+    if (fsevent->xattrs.pairs == NULL)
+        return -1;
 
-    return process_step != 1 ? 1 : 0;
+    /* Will be changed later to retrieve only the modified values,
+     * i.e. trusted.lov.
+     */
+    return build_lustre_xattrs_event(expansion_push(expansion));
 }
 
 /* FLRW events are events that happen when writing data to a mirrored file in
@@ -829,37 +820,20 @@ build_layout_events(unsigned int process_step, struct rbh_fsevent *fsevent)
  * the Lustre information for that file.
  */
 static int
-build_flrw_events(unsigned int process_step, struct rbh_fsevent *fsevent)
+build_flrw_events(struct expansion *expansion)
 {
-    uint32_t statx_enrich_mask = 0;
-
-    assert(process_step < 2);
-    switch(process_step) {
-    case 0:
-        statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC |
-                            RBH_STATX_MTIME_SEC | RBH_STATX_MTIME_NSEC |
-                            RBH_STATX_BLOCKS | RBH_STATX_SIZE;
-        if (build_statx_event(statx_enrich_mask, fsevent, NULL))
-            return -1;
-
-        break;
-    case 1:
-        fsevent->type = RBH_FET_XATTR;
-
-        /* Mark this fsevent for Lustre enrichment to retrieve all Lustre
-         * values. Will be changed later to retrieve only the modified values,
-         * i.e. layout (especially the component flags).
-         */
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "rbh-fsevents",
-                                       build_empty_map("lustre"),
-                                       NULL))
-            return -1;
+    uint32_t statx_enrich_mask;
 
-        break;
-    }
+    statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC |
+                        RBH_STATX_MTIME_SEC | RBH_STATX_MTIME_NSEC |
+                        RBH_STATX_BLOCKS | RBH_STATX_SIZE;
+    if (build_statx_event(statx_enrich_mask, expansion_push(expansion), NULL))
+        return -1;
 
-    return process_step != 1 ? 1 : 0;
+    /* Will be changed later to retrieve only the modified values,
+     * i.e. layout (especially the component flags).
+     */
+    return build_lustre_xattrs_event(expansion_push(expansion));
 }
 
 /* Resync events are events that happen when synchronizing a mirrored file in
@@ -869,157 +843,295 @@ build_flrw_events(unsigned int process_step, struct rbh_fsevent *fsevent)
  * values.
  */
 static int
-build_resync_events(unsigned int process_step, struct rbh_fsevent *fsevent)
+build_resync_events(struct expansion *expansion)
 {
-    uint32_t statx_enrich_mask = 0;
-
-    assert(process_step < 2);
-    switch(process_step) {
-    case 0:
-        statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC |
-                            RBH_STATX_BLOCKS;
-        if (build_statx_event(statx_enrich_mask, fsevent, NULL))
-            return -1;
-
-        break;
-    case 1:
-        fsevent->type = RBH_FET_XATTR;
-
-        /* Mark this fsevent for Lustre enrichment to retrieve all Lustre
-         * values. Will be changed later to retrieve only the modified values,
-         * i.e. layout (especially the component flags).
-         */
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "rbh-fsevents",
-                                       build_empty_map("lustre"),
-                                       NULL))
-            return -1;
+    uint32_t statx_enrich_mask;
 
-        break;
-    }
+    statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC |
+                        RBH_STATX_BLOCKS;
+    if (build_statx_event(statx_enrich_mask, expansion_push(expansion), NULL))
+        return -1;
 
-    return process_step != 1 ? 1 : 0;
+    /* Will be changed later to retrieve only the modified values,
+     * i.e. layout (especially the component flags).
+     */
+    return build_lustre_xattrs_event(expansion_push(expansion));
 }
 
 /* Migrate events only correspond to metadata changes, meaning we only have to
  * change the target and target's parent striping information.
  */
 static int
-build_migrate_events(unsigned int process_step, struct changelog_rec *record,
-                     struct rbh_fsevent *fsevent)
+build_migrate_events(struct changelog_rec *record, struct expansion *expansion)
 {
     struct changelog_ext_rename *migrate_log = changelog_rec_rename(record);
+    const struct rbh_id *target;
+    struct rbh_id *source_parent;
+    struct rbh_id *parent;
     struct rbh_id *id;
 
-    /* If the process step is 3, we change the targeted id to the source so that
-     * we can unlink it properly.
+    parent = build_id(&record->cr_pfid);
+    if (parent == NULL)
+        return -1;
+
+    /* create new link */
+    /* This new link is necessary because a metadata migration changes the
+     * FID of the entry.
      */
-    if (process_step == 3) {
-        id = build_id(&migrate_log->cr_sfid);
-        if (id == NULL)
-            return -1;
+    if (new_link_inode_event(record, parent, expansion_push(expansion)))
+        return -1;
 
-        fsevent->id.data = id->data;
-        fsevent->id.size = id->size;
-    }
+    /* update target statx */
+    if (update_statx_without_uid_gid_event(record, expansion_push(expansion)))
+        return -1;
 
-    assert(process_step < 6);
-    switch (process_step) {
-    case 0: /* create new link */
-        /* This new link is necessary because a metadata migration changes the
-         * FID of the entry.
-         */
-        if (new_link_inode_event(record, fsevent))
-            return -1;
+    /* update target's parent statx */
+    if (update_parent_acmtime_event(parent, expansion_push(expansion)))
+        return -1;
 
-        break;
-    case 1: /* update target statx */
-        if (update_statx_without_uid_gid_event(record, fsevent))
-            return -1;
+    /* unlink source link, which is identified by the source FID */
+    source_parent = build_id(&migrate_log->cr_spfid);
+    if (source_parent == NULL)
+        return -1;
 
-        break;
-    case 2: /* update target's parent statx */
-        if (update_parent_acmtime_event(&record->cr_pfid, fsevent))
-            return -1;
+    id = build_id(&migrate_log->cr_sfid);
+    if (id == NULL)
+        return -1;
 
-        break;
-    case 3: /* unlink source link */
-        if (unlink_inode_event(&migrate_log->cr_spfid,
-                               changelog_rec_sname(record),
-                               changelog_rec_snamelen(record),
-                               true, fsevent))
-            return -1;
-        break;
-    case 4: /* update source's parent statx */
-        if (update_parent_acmtime_event(&migrate_log->cr_spfid, fsevent))
-            return -1;
+    target = expansion->id;
+    expansion->id = id;
+    if (unlink_inode_event(source_parent, changelog_rec_sname(record),
+                           changelog_rec_snamelen(record), true,
+                           expansion_push(expansion)))
+        return -1;
 
-        break;
-    case 5: /* update target striping info */
-        fsevent->type = RBH_FET_XATTR;
+    /* update source's parent statx */
+    if (update_parent_acmtime_event(source_parent, expansion_push(expansion)))
+        return -1;
 
-        if (build_enrich_xattr_fsevent(&fsevent->xattrs,
-                                       "rbh-fsevents",
-                                       build_empty_map("lustre"),
-                                       NULL))
-            return -1;
+    /* update target striping info */
+    expansion->id = target;
+    return build_lustre_xattrs_event(expansion_push(expansion));
+}
+
+/*----------------------------------------------------------------------------*
+ |                                  prefetch                                  |
+ *----------------------------------------------------------------------------*/
+
+/* Records are read from the changelog on a thread of their own, so that the
+ * MDS can keep sending them while fsevents are enriched and sent to the sink.
+ * Once the changelog has no more records to send, or an error occurs, the
+ * prefetcher pushes END and stops.
+ */
+static char END;
+
+/* Leave the consumer time to catch up, rather than push records one at a
+ * time as soon as it pops them.
+ */
+static bool
+prefetcher_may_push(struct prefetcher *prefetcher)
+{
+    return ring_length(prefetcher->records) <= prefetcher->options.low
+        || atomic_load_explicit(&prefetcher->stop, memory_order_relaxed);
+}
 
-        break;
+static bool
+prefetcher_may_pop(struct prefetcher *prefetcher)
+{
+    return ring_length(prefetcher->records) > 0;
+}
+
+/* Like ring_push() and ring_pop(): spin a little, then yield the CPU, then
+ * sleep until the other end of the ring wakes us up.
+ */
+static void
+prefetcher_wait(struct prefetcher *prefetcher, atomic_bool *asleep,
+                bool (*ready)(struct prefetcher *prefetcher))
+{
+    for (unsigned int attempts = 0; !ready(prefetcher); attempts++) {
+        if (attempts < 64) {
+            atomic_signal_fence(memory_order_seq_cst);
+            continue;
+        }
+        if (attempts < 1024) {
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&prefetcher->lock);
+        atomic_store(asleep, true);
+        /* Pairs with the fence in prefetcher_wake() */
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!ready(prefetcher))
+            pthread_cond_wait(&prefetcher->cond, &prefetcher->lock);
+        atomic_store(asleep, false);
+        pthread_mutex_unlock(&prefetcher->lock);
+        return;
     }
+}
+
+/* Wake up one end of the ring if it waits in prefetcher_wait() */
+static void
+prefetcher_wake(struct prefetcher *prefetcher, atomic_bool *asleep)
+{
+    /* Either the sleeper sees what was done to the ring before it sleeps, or
+     * it is seen asleep here.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(asleep, memory_order_relaxed))
+        return;
 
-    return process_step != 5 ? 1 : 0;
+    pthread_mutex_lock(&prefetcher->lock);
+    pthread_cond_broadcast(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->lock);
 }
 
-static const void *
-lustre_changelog_iter_next(void *iterator)
+/* Same as ring_push(), but the producer waits for the ring to drain below the
+ * low watermark once it reached the high one.
+ */
+static void
+prefetcher_push(struct prefetcher *prefetcher, void *record)
 {
-    struct lustre_changelog_iterator *records = iterator;
-    struct rbh_fsevent *fsevent = NULL;
-    uint32_t statx_enrich_mask = 0;
-    struct changelog_rec *record;
-    struct rbh_id *id;
-    int save_errno;
-    int rc;
+    if (ring_length(prefetcher->records) >= prefetcher->options.high)
+        prefetcher_wait(prefetcher, &prefetcher->producer_asleep,
+                        prefetcher_may_push);
 
-    _values_flush(_values);
+    ring_push(prefetcher->records, record);
+    prefetcher_wake(prefetcher, &prefetcher->consumer_asleep);
+}
+
+static void *
+prefetcher_pop(struct prefetcher *prefetcher)
+{
+    void *record;
+
+    prefetcher_wait(prefetcher, &prefetcher->consumer_asleep,
+                    prefetcher_may_pop);
+    record = ring_pop(prefetcher->records);
+
+    if (ring_length(prefetcher->records) <= prefetcher->options.low)
+        prefetcher_wake(prefetcher, &prefetcher->producer_asleep);
+    return record;
+}
+
+static void *
+prefetcher_routine(void *arg)
+{
+    struct lustre_changelog_iterator *records = arg;
+    struct prefetcher *prefetcher = records->prefetcher;
+
+    while (!atomic_load_explicit(&prefetcher->stop, memory_order_relaxed)) {
+        struct changelog_rec *record;
+        int rc;
 
-retry:
-    if (records->prev_record == NULL) {
         rc = llapi_changelog_recv(records->reader, &record);
-        if (rc < 0) {
-            errno = -rc;
-            return NULL;
-        }
-        if (rc > 0) {
-            errno = ENODATA;
-            return NULL;
+        if (rc) {
+            prefetcher->rc = rc;
+            break;
         }
-        records->process_step = 0;
-    } else {
-        record = records->prev_record;
-        records->prev_record = NULL;
+
+        prefetcher_push(prefetcher, record);
     }
 
-    fsevent = rbh_sstack_push(_values, NULL, sizeof(*fsevent));
-    if (fsevent == NULL)
-        goto end_event;
-    memset(fsevent, 0, sizeof(*fsevent));
+    prefetcher_push(prefetcher, &END);
+    return NULL;
+}
 
-    id = build_id(&record->cr_tfid);
-    if (id == NULL)
-        goto err;
+static void
+prefetcher_start(struct lustre_changelog_iterator *records,
+                 const struct prefetch_options *options)
+{
+    struct prefetcher *prefetcher;
+
+    prefetcher = malloc(sizeof(*prefetcher));
+    if (prefetcher == NULL)
+        error(EXIT_FAILURE, errno, "malloc");
+
+    /* Leave room for END */
+    prefetcher->records = ring_new(options->depth + 1);
+    if (prefetcher->records == NULL)
+        error(EXIT_FAILURE, errno, "ring_new");
+
+    prefetcher->options = *options;
+    prefetcher->rc = 0;
+    atomic_init(&prefetcher->stop, false);
+    prefetcher->ended = false;
+
+    errno = pthread_mutex_init(&prefetcher->lock, NULL);
+    if (errno)
+        error(EXIT_FAILURE, errno, "pthread_mutex_init");
+    errno = pthread_cond_init(&prefetcher->cond, NULL);
+    if (errno)
+        error(EXIT_FAILURE, errno, "pthread_cond_init");
+    atomic_init(&prefetcher->producer_asleep, false);
+    atomic_init(&prefetcher->consumer_asleep, false);
+
+    records->prefetcher = prefetcher;
+    errno = pthread_create(&prefetcher->thread, NULL, prefetcher_routine,
+                           records);
+    if (errno)
+        error(EXIT_FAILURE, errno, "pthread_create");
+}
+
+static void
+prefetcher_stop(struct prefetcher *prefetcher)
+{
+    atomic_store_explicit(&prefetcher->stop, true, memory_order_relaxed);
+    prefetcher_wake(prefetcher, &prefetcher->producer_asleep);
+
+    /* Unblock the prefetcher, should it wait for room in the ring */
+    while (!prefetcher->ended) {
+        struct changelog_rec *record = prefetcher_pop(prefetcher);
+
+        if (record == (void *)&END)
+            prefetcher->ended = true;
+        else
+            llapi_changelog_free(&record);
+    }
+
+    pthread_join(prefetcher->thread, NULL);
+    pthread_cond_destroy(&prefetcher->cond);
+    pthread_mutex_destroy(&prefetcher->lock);
+    ring_destroy(prefetcher->records);
+    free(prefetcher);
+}
+
+/* Same as llapi_changelog_recv() */
+static int
+changelog_recv(struct lustre_changelog_iterator *records,
+               struct changelog_rec **record)
+{
+    struct prefetcher *prefetcher = records->prefetcher;
+
+    if (records->next_record) {
+        *record = records->next_record;
+        records->next_record = NULL;
+        return 0;
+    }
+
+    if (prefetcher == NULL)
+        return llapi_changelog_recv(records->reader, record);
+
+    if (prefetcher->ended)
+        return prefetcher->rc;
 
-    fsevent->id.data = id->data;
-    fsevent->id.size = id->size;
+    *record = prefetcher_pop(prefetcher);
+    if (*record == (void *)&END) {
+        prefetcher->ended = true;
+        return prefetcher->rc;
+    }
+    return 0;
+}
+
+/* Enrichment mask of the single statx update \p record expands into, 0 if it
+ * expands into anything else.
+ */
+static uint32_t
+statx_update_mask(const struct changelog_rec *record)
+{
+    uint32_t statx_enrich_mask = 0;
 
     switch(record->cr_type) {
-    case CL_CREATE:
-    case CL_MKDIR:
-        rc = build_create_inode_events(records->process_step, record, fsevent);
-        break;
-    case CL_SETXATTR:
-        rc = build_setxattr_event(records->process_step, record, fsevent);
-        break;
     case CL_SETATTR:
         statx_enrich_mask = RBH_STATX_ALL;
         /* fall through */
@@ -1033,79 +1145,172 @@ retry:
         /* fall through */
     case CL_ATIME:
         statx_enrich_mask |= RBH_STATX_ATIME_SEC | RBH_STATX_ATIME_NSEC;
-        rc = build_statx_event(statx_enrich_mask, fsevent, NULL);
-        break;
+        return statx_enrich_mask;
+    case CL_TRUNC:
+        return RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC |
+               RBH_STATX_MTIME_SEC | RBH_STATX_MTIME_NSEC |
+               RBH_STATX_SIZE;
+    default:
+        return 0;
+    }
+}
+
+static bool
+record_is_wanted(const struct lustre_changelog_iterator *records,
+                 const struct changelog_rec *record)
+{
+    return record->cr_type < CL_LAST
+        && (records->types & RECORD_TYPE(record->cr_type));
+}
+
+/* The next record, provided it is already prefetched, NULL otherwise */
+static struct changelog_rec *
+changelog_peek(struct lustre_changelog_iterator *records)
+{
+    struct prefetcher *prefetcher = records->prefetcher;
+
+    if (records->next_record == NULL && prefetcher != NULL
+     && !prefetcher->ended && ring_length(prefetcher->records) > 0
+     && changelog_recv(records, &records->next_record) != 0)
+        records->next_record = NULL;
+
+    return records->next_record;
+}
+
+/* Consume the records that follow \p record and only update the statx of the
+ * same entry as \p record does, as long as they are prefetched already.
+ *
+ * Tools which checkpoint their output often generate storms of such records,
+ * which all expand into a single statx update once folded. Returns the
+ * enrichment mask of that update.
+ */
+static uint32_t
+fold_statx_updates(struct lustre_changelog_iterator *records,
+                   struct changelog_rec *record, uint32_t statx_enrich_mask)
+{
+    struct changelog_rec *next;
+
+    while ((next = changelog_peek(records)) != NULL) {
+        /* Records that are skipped anyway do not interrupt the fold */
+        if (record_is_wanted(records, next)) {
+            uint32_t next_mask = statx_update_mask(next);
+
+            if (next_mask == 0
+             || memcmp(&next->cr_tfid, &record->cr_tfid,
+                       sizeof(record->cr_tfid)))
+                break;
+
+            statx_enrich_mask |= next_mask;
+        }
+        records->time = next->cr_time;
+        records->index = next->cr_index;
+
+        records->next_record = NULL;
+        llapi_changelog_free(&next);
+    }
+
+    return statx_enrich_mask;
+}
+
+/* Expand \p record into records->expansion, \p statx_enrich_mask is that of
+ * the statx update it folds into, if any.
+ */
+static int
+expand_record(struct lustre_changelog_iterator *records,
+              struct changelog_rec *record, uint32_t statx_enrich_mask)
+{
+    struct expansion *expansion = &records->expansion;
+    struct rbh_id *id;
+
+    expansion->count = 0;
+    id = build_id(&record->cr_tfid);
+    if (id == NULL)
+        return -1;
+    expansion->id = id;
+
+    if (statx_enrich_mask)
+        return build_statx_event(statx_enrich_mask, expansion_push(expansion),
+                                 NULL);
+
+    switch(record->cr_type) {
+    case CL_CREATE:
+    case CL_MKDIR:
+        return build_create_inode_events(record, expansion);
+    case CL_SETXATTR:
+        return build_setxattr_event(record, expansion);
     case CL_SOFTLINK:
-        rc = build_softlink_events(records->process_step, record, fsevent);
-        break;
+        return build_softlink_events(record, expansion);
     case CL_HARDLINK:
     case CL_MKNOD:
-        rc = build_hardlink_or_mknod_events(records->process_step, record,
-                                            fsevent);
-        break;
+        return build_hardlink_or_mknod_events(record, expansion);
     case CL_RMDIR:
     case CL_UNLINK:
-        rc = build_unlink_or_rmdir_events(records->process_step, record,
-                                          fsevent);
-        break;
+        return build_unlink_or_rmdir_events(record, expansion);
     case CL_RENAME:
-        rc = build_rename_events(records->process_step, record, fsevent);
-        break;
+        return build_rename_events(record, expansion);
     case CL_HSM:
-        rc = build_hsm_events(records->process_step, fsevent);
-        break;
-    case CL_TRUNC:
-        statx_enrich_mask = RBH_STATX_CTIME_SEC | RBH_STATX_CTIME_NSEC |
-                            RBH_STATX_MTIME_SEC | RBH_STATX_MTIME_NSEC |
-                            RBH_STATX_SIZE;
-        rc = build_statx_event(statx_enrich_mask, fsevent, NULL);
-        break;
+        return build_hsm_events(expansion);
     case CL_LAYOUT:
-        rc = build_layout_events(records->process_step, fsevent);
-        break;
+        return build_layout_events(expansion);
     case CL_FLRW:
-        rc = build_flrw_events(records->process_step, fsevent);
-        break;
+        return build_flrw_events(expansion);
     case CL_RESYNC:
-        rc = build_resync_events(records->process_step, fsevent);
-        break;
+        return build_resync_events(expansion);
     case CL_MIGRATE:
-        rc = build_migrate_events(records->process_step, record, fsevent);
-        break;
-    case CL_EXT:
-    case CL_OPEN:
-    case CL_GETXATTR:
-    case CL_DN_OPEN:
-        fsevent = fsevent_from_record(record);
-        goto end_event;
-    default: /* CL_MARK or other events */
-        /* Events not managed yet, we go to the next record */
-        llapi_changelog_free(&record);
-        goto retry;
+        return build_migrate_events(record, expansion);
+    default:
+        /* Only the types in RECORD_TYPES_SUPPORTED are ever expanded */
+        __builtin_unreachable();
     }
+}
 
-    if (rc == -1)
-        goto err;
-    else if (rc == 1) /* record is partially parsed */
-        goto save_event;
-    else /* record is fully parsed */
-        goto end_event;
+static const void *
+lustre_changelog_iter_next(void *iterator)
+{
+    struct lustre_changelog_iterator *records = iterator;
+    struct expansion *expansion = &records->expansion;
+    struct changelog_rec *record;
+    uint32_t statx_enrich_mask;
+    int save_errno;
+    int rc;
 
-err:
-    fsevent = NULL;
+    while (records->position == expansion->count) {
+        expansion->count = records->position = 0;
 
-end_event:
-    save_errno = errno;
-    llapi_changelog_free(&record);
-    errno = save_errno;
+        rc = changelog_recv(records, &record);
+        if (rc < 0) {
+            errno = -rc;
+            return NULL;
+        }
+        if (rc > 0) {
+            errno = ENODATA;
+            return NULL;
+        }
+        records->time = record->cr_time;
+        records->first_index = records->index = record->cr_index;
 
-    return fsevent;
+        if (!record_is_wanted(records, record)) {
+            llapi_changelog_free(&record);
+            continue;
+        }
 
-save_event:
-    records->prev_record = record;
-    ++records->process_step;
+        statx_enrich_mask = statx_update_mask(record);
+        if (statx_enrich_mask)
+            statx_enrich_mask = fold_statx_updates(records, record,
+                                                   statx_enrich_mask);
 
-    return fsevent;
+        _values = arena_values(records->arena, records->index);
+        rc = expand_record(records, record, statx_enrich_mask);
+        save_errno = errno;
+        llapi_changelog_free(&record);
+        if (rc) {
+            expansion->count = 0;
+            errno = save_errno;
+            return NULL;
+        }
+    }
+
+    return &expansion->fsevents[records->position++];
 }
 
 static void
@@ -1113,7 +1318,11 @@ lustre_changelog_iter_destroy(void *iterator)
 {
     struct lustre_changelog_iterator *records = iterator;
 
-    rbh_sstack_destroy(_values);
+    if (records->next_record)
+        llapi_changelog_free(&records->next_record);
+    if (records->prefetcher)
+        prefetcher_stop(records->prefetcher);
+    arena_destroy(records->arena);
     llapi_changelog_fini(&records->reader);
 }
 
@@ -1126,12 +1335,47 @@ static const struct rbh_iterator LUSTRE_CHANGELOG_ITERATOR = {
     .ops = &LUSTRE_CHANGELOG_ITER_OPS,
 };
 
+/* Parse a comma separated list of record types, eg. "CREAT,UNLNK" */
+static uint64_t
+parse_record_types(const char *list)
+{
+    uint64_t types = 0;
+
+    if (list == NULL)
+        return RECORD_TYPES_SUPPORTED;
+
+    while (true) {
+        size_t length = strcspn(list, ",");
+        int type;
+
+        for (type = 0; type < CL_LAST; type++) {
+            const char *name = changelog_type2str(type);
+
+            if (strlen(name) == length && strncasecmp(name, list, length) == 0)
+                break;
+        }
+
+        if (type == CL_LAST || !(RECORD_TYPES_SUPPORTED & RECORD_TYPE(type)))
+            error(EX_USAGE, EINVAL, "unsupported changelog record type: %.*s",
+                  (int)length, list);
+        types |= RECORD_TYPE(type);
+
+        if (list[length] == '\0')
+            return types;
+        list += length + 1;
+    }
+}
+
 static void
 lustre_changelog_init(struct lustre_changelog_iterator *events,
-                      const char *mdtname)
+                      const char *mdtname, const char *record_types,
+                      const struct prefetch_options *prefetch)
 {
+    int xflags = 0;
     int rc;
 
+    events->types = parse_record_types(record_types);
+
     rc = llapi_changelog_start(&events->reader,
                                CHANGELOG_FLAG_JOBID |
                                CHANGELOG_FLAG_EXTRA_FLAGS,
@@ -1139,21 +1383,31 @@ lustre_changelog_init(struct lustre_changelog_iterator *events,
     if (rc < 0)
         error(EXIT_FAILURE, -rc, "llapi_changelog_start");
 
-    rc = llapi_changelog_set_xflags(events->reader,
-                                    CHANGELOG_EXTRA_FLAG_UIDGID |
-                                    CHANGELOG_EXTRA_FLAG_NID |
-                                    CHANGELOG_EXTRA_FLAG_OMODE |
-                                    CHANGELOG_EXTRA_FLAG_XATTR);
+    /* Only have the MDS send the extra fields fsevents are built from */
+    if (events->types & RECORD_TYPES_UIDGID)
+        xflags |= CHANGELOG_EXTRA_FLAG_UIDGID;
+    if (events->types & RECORD_TYPE(CL_SETXATTR))
+        xflags |= CHANGELOG_EXTRA_FLAG_XATTR;
+
+    rc = llapi_changelog_set_xflags(events->reader, xflags);
     if (rc < 0)
         error(EXIT_FAILURE, -rc, "llapi_changelog_set_xflags");
 
     events->iterator = LUSTRE_CHANGELOG_ITERATOR;
+    events->prefetcher = NULL;
+    if (prefetch->depth > 0)
+        prefetcher_start(events, prefetch);
 }
 
 struct lustre_source {
     struct source source;
 
     struct lustre_changelog_iterator events;
+
+    const char *mdtname;
+    const char *username;
+    /* Index of the last record cleared from the changelog */
+    __u64 cleared;
 };
 
 static const void *
@@ -1178,15 +1432,68 @@ static const struct rbh_iterator_operations SOURCE_ITER_OPS = {
     .destroy = source_iter_destroy,
 };
 
+static void
+lustre_source_timestamp(void *_source, struct timespec *timestamp)
+{
+    struct lustre_source *source = _source;
+
+    /* cr_time stores seconds in its upper 34 bits, nanoseconds in the rest */
+    timestamp->tv_sec = source->events.time >> 30;
+    timestamp->tv_nsec = source->events.time & ((1 << 30) - 1);
+}
+
+static uint64_t
+lustre_source_checkpoint(void *_source)
+{
+    struct lustre_source *source = _source;
+
+    /* The current records still have fsevents to yield */
+    if (source->events.position < source->events.expansion.count)
+        return source->events.first_index - 1;
+    return source->events.index;
+}
+
+static int
+lustre_source_acknowledge(void *_source, uint64_t checkpoint)
+{
+    struct lustre_source *source = _source;
+    int rc;
+
+    arena_release(source->events.arena, checkpoint);
+
+    if (source->username == NULL || checkpoint <= source->cleared)
+        return 0;
+
+    /* One call per batch, the MDS clears every record up to checkpoint */
+    rc = llapi_changelog_clear(source->mdtname, source->username, checkpoint);
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+
+    source->cleared = checkpoint;
+    return 0;
+}
+
+static const struct source_operations LUSTRE_SOURCE_OPS = {
+    .timestamp = lustre_source_timestamp,
+    .checkpoint = lustre_source_checkpoint,
+    .acknowledge = lustre_source_acknowledge,
+};
+
 static const struct source LUSTRE_SOURCE = {
     .name = "lustre",
     .fsevents = {
         .ops = &SOURCE_ITER_OPS,
     },
+    .ops = &LUSTRE_SOURCE_OPS,
+    .retains = true,
 };
 
 struct source *
-source_from_lustre_changelog(const char *mdtname)
+source_from_lustre_changelog(const char *mdtname, const char *username,
+                             const char *record_types,
+                             const struct prefetch_options *prefetch)
 {
     struct lustre_source *source;
 
@@ -1194,10 +1501,20 @@ source_from_lustre_changelog(const char *mdtname)
     if (source == NULL)
         error(EXIT_FAILURE, errno, "malloc");
 
-    lustre_changelog_init(&source->events, mdtname);
-
-    _values = rbh_sstack_new(sizeof(struct rbh_value_pair) * (1 << 7));
-    source->events.prev_record = NULL;
+    lustre_changelog_init(&source->events, mdtname, record_types, prefetch);
+
+    source->events.arena = arena_new(FSEVENT_COPY_CHUNK_SIZE);
+    if (source->events.arena == NULL)
+        error(EXIT_FAILURE, errno, "arena_new");
+    source->events.expansion.count = 0;
+    source->events.position = 0;
+    source->events.next_record = NULL;
+    source->events.time = 0;
+    source->events.first_index = 0;
+    source->events.index = 0;
+    source->mdtname = mdtname;
+    source->username = username;
+    source->cleared = 0;
     source->source = LUSTRE_SOURCE;
     return &source->source;
 }
@@ -0,0 +1,420 @@
+/* SPDX-License-Identifer: LGPL-3.0-or-later */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "utils.h"
+
+void
+merge_statx(struct rbh_statx *original, const struct rbh_statx *override)
+{
+    original->stx_mask |= override->stx_mask;
+
+    if (override->stx_mask & RBH_STATX_TYPE)
+        original->stx_mode = (original->stx_mode & ~S_IFMT)
+                           | (override->stx_mode & S_IFMT);
+
+    if (override->stx_mask & RBH_STATX_MODE)
+        original->stx_mode = (original->stx_mode & S_IFMT)
+                           | (override->stx_mode & ~S_IFMT);
+
+    if (override->stx_mask & RBH_STATX_NLINK)
+        original->stx_nlink = override->stx_nlink;
+
+    if (override->stx_mask & RBH_STATX_UID)
+        original->stx_uid = override->stx_uid;
+
+    if (override->stx_mask & RBH_STATX_GID)
+        original->stx_gid = override->stx_gid;
+
+    if (override->stx_mask & RBH_STATX_ATIME_SEC)
+        original->stx_atime.tv_sec = override->stx_atime.tv_sec;
+
+    if (override->stx_mask & RBH_STATX_CTIME_SEC)
+        original->stx_ctime.tv_sec = override->stx_ctime.tv_sec;
+
+    if (override->stx_mask & RBH_STATX_MTIME_SEC)
+        original->stx_mtime.tv_sec = override->stx_mtime.tv_sec;
+
+    if (override->stx_mask & RBH_STATX_INO)
+        original->stx_ino = override->stx_ino;
+
+    if (override->stx_mask & RBH_STATX_SIZE)
+        original->stx_size = override->stx_size;
+
+    if (override->stx_mask & RBH_STATX_BLOCKS)
+        original->stx_blocks = override->stx_blocks;
+
+    if (override->stx_mask & RBH_STATX_BTIME_SEC)
+        original->stx_btime.tv_sec = override->stx_btime.tv_sec;
+
+    if (override->stx_mask & RBH_STATX_MNT_ID)
+        original->stx_mnt_id = override->stx_mnt_id;
+
+    if (override->stx_mask & RBH_STATX_BLKSIZE)
+        original->stx_blksize = override->stx_blksize;
+
+    if (override->stx_mask & RBH_STATX_ATTRIBUTES) {
+        original->stx_attributes_mask = override->stx_attributes_mask;
+        original->stx_attributes = override->stx_attributes;
+    }
+
+    if (override->stx_mask & RBH_STATX_ATIME_NSEC)
+        original->stx_atime.tv_nsec = override->stx_atime.tv_nsec;
+
+    if (override->stx_mask & RBH_STATX_BTIME_NSEC)
+        original->stx_btime.tv_nsec = override->stx_btime.tv_nsec;
+
+    if (override->stx_mask & RBH_STATX_CTIME_NSEC)
+        original->stx_ctime.tv_nsec = override->stx_ctime.tv_nsec;
+
+    if (override->stx_mask & RBH_STATX_MTIME_NSEC)
+        original->stx_mtime.tv_nsec = override->stx_mtime.tv_nsec;
+
+    if (override->stx_mask & RBH_STATX_RDEV_MAJOR)
+        original->stx_rdev_major = override->stx_rdev_major;
+
+    if (override->stx_mask & RBH_STATX_RDEV_MINOR)
+        original->stx_rdev_minor = override->stx_rdev_minor;
+
+    if (override->stx_mask & RBH_STATX_DEV_MAJOR)
+        original->stx_dev_major = override->stx_dev_major;
+
+    if (override->stx_mask & RBH_STATX_DEV_MINOR)
+        original->stx_dev_minor = override->stx_dev_minor;
+}
+
+static uint64_t
+mix(uint64_t hash)
+{
+    /* The finalizer of MurmurHash3 */
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    hash *= UINT64_C(0xc4ceb9fe1a85ec53);
+    hash ^= hash >> 33;
+    return hash;
+}
+
+size_t
+id_hash(const struct rbh_id *id)
+{
+    uint64_t hash = id->size;
+    uint64_t word;
+    size_t i;
+
+    /* Ids are mostly file handles of a few dozen bytes, process them a word
+     * at a time.
+     */
+    for (i = 0; i + sizeof(word) <= id->size; i += sizeof(word)) {
+        memcpy(&word, id->data + i, sizeof(word));
+        hash = mix(hash ^ word);
+    }
+
+    word = 0;
+    if (i < id->size)
+        memcpy(&word, id->data + i, id->size - i);
+    return mix(hash ^ word);
+}
+
+bool
+id_equal(const struct rbh_id *first, const struct rbh_id *second)
+{
+    return first->size == second->size
+        && memcmp(first->data, second->data, first->size) == 0;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                 deep copy                                  |
+ *----------------------------------------------------------------------------*/
+
+static const char *
+string_copy(const char *string, struct rbh_sstack *values)
+{
+    return rbh_sstack_push(values, string, strlen(string) + 1);
+}
+
+struct rbh_id *
+id_copy(const struct rbh_id *id, struct rbh_sstack *values)
+{
+    struct rbh_id *copy;
+    char *data;
+
+    copy = rbh_sstack_push(values, NULL, sizeof(*copy));
+    if (copy == NULL)
+        return NULL;
+
+    copy->size = id->size;
+    if (id->size == 0) {
+        copy->data = NULL;
+        return copy;
+    }
+
+    data = rbh_sstack_push(values, id->data, id->size);
+    if (data == NULL)
+        return NULL;
+
+    copy->data = data;
+    return copy;
+}
+
+static int
+value_copy(struct rbh_value *dest, const struct rbh_value *src,
+           struct rbh_sstack *values);
+
+static int
+sequence_copy(struct rbh_value *dest, const struct rbh_value *src,
+              struct rbh_sstack *values)
+{
+    struct rbh_value *copies;
+
+    dest->sequence.count = src->sequence.count;
+    if (src->sequence.count == 0) {
+        dest->sequence.values = NULL;
+        return 0;
+    }
+
+    copies = rbh_sstack_push(values, NULL,
+                             src->sequence.count * sizeof(*copies));
+    if (copies == NULL)
+        return -1;
+
+    for (size_t i = 0; i < src->sequence.count; i++) {
+        if (value_copy(&copies[i], &src->sequence.values[i], values))
+            return -1;
+    }
+
+    dest->sequence.values = copies;
+    return 0;
+}
+
+static int
+value_copy(struct rbh_value *dest, const struct rbh_value *src,
+           struct rbh_sstack *values)
+{
+    *dest = *src;
+
+    switch (src->type) {
+    case RBH_VT_BOOLEAN:
+    case RBH_VT_INT32:
+    case RBH_VT_UINT32:
+    case RBH_VT_INT64:
+    case RBH_VT_UINT64:
+        return 0;
+    case RBH_VT_STRING:
+        dest->string = string_copy(src->string, values);
+        return dest->string == NULL ? -1 : 0;
+    case RBH_VT_BINARY:
+        if (src->binary.size == 0)
+            return 0;
+        dest->binary.data = rbh_sstack_push(values, src->binary.data,
+                                            src->binary.size);
+        return dest->binary.data == NULL ? -1 : 0;
+    case RBH_VT_REGEX:
+        dest->regex.string = string_copy(src->regex.string, values);
+        return dest->regex.string == NULL ? -1 : 0;
+    case RBH_VT_SEQUENCE:
+        return sequence_copy(dest, src, values);
+    case RBH_VT_MAP:
+        return value_map_copy(&dest->map, &src->map, values);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int
+value_map_copy(struct rbh_value_map *dest, const struct rbh_value_map *src,
+               struct rbh_sstack *values)
+{
+    struct rbh_value_pair *pairs;
+
+    dest->count = src->count;
+    if (src->count == 0) {
+        dest->pairs = NULL;
+        return 0;
+    }
+
+    pairs = rbh_sstack_push(values, NULL, src->count * sizeof(*pairs));
+    if (pairs == NULL)
+        return -1;
+
+    for (size_t i = 0; i < src->count; i++) {
+        const struct rbh_value_pair *pair = &src->pairs[i];
+        struct rbh_value *value;
+
+        pairs[i].key = string_copy(pair->key, values);
+        if (pairs[i].key == NULL)
+            return -1;
+
+        if (pair->value == NULL) {
+            pairs[i].value = NULL;
+            continue;
+        }
+
+        value = rbh_sstack_push(values, NULL, sizeof(*value));
+        if (value == NULL)
+            return -1;
+
+        if (value_copy(value, pair->value, values))
+            return -1;
+        pairs[i].value = value;
+    }
+
+    dest->pairs = pairs;
+    return 0;
+}
+
+int
+fsevent_copy(struct rbh_fsevent *dest, const struct rbh_fsevent *src,
+             struct rbh_sstack *values)
+{
+    struct rbh_id *id;
+
+    *dest = *src;
+
+    id = id_copy(&src->id, values);
+    if (id == NULL)
+        return -1;
+    dest->id = *id;
+
+    if (value_map_copy(&dest->xattrs, &src->xattrs, values))
+        return -1;
+
+    switch (src->type) {
+    case RBH_FET_UPSERT:
+        if (src->upsert.statx) {
+            dest->upsert.statx = rbh_sstack_push(values, src->upsert.statx,
+                                                 sizeof(*src->upsert.statx));
+            if (dest->upsert.statx == NULL)
+                return -1;
+        }
+
+        if (src->upsert.symlink) {
+            dest->upsert.symlink = string_copy(src->upsert.symlink, values);
+            if (dest->upsert.symlink == NULL)
+                return -1;
+        }
+        return 0;
+    case RBH_FET_LINK:
+    case RBH_FET_UNLINK:
+        dest->link.parent_id = id_copy(src->link.parent_id, values);
+        if (dest->link.parent_id == NULL)
+            return -1;
+
+        dest->link.name = string_copy(src->link.name, values);
+        return dest->link.name == NULL ? -1 : 0;
+    case RBH_FET_DELETE:
+        return 0;
+    case RBH_FET_XATTR:
+        /* inode xattrs have no namespace information */
+        if (src->ns.parent_id == NULL)
+            return 0;
+
+        dest->ns.parent_id = id_copy(src->ns.parent_id, values);
+        if (dest->ns.parent_id == NULL)
+            return -1;
+
+        dest->ns.name = string_copy(src->ns.name, values);
+        return dest->ns.name == NULL ? -1 : 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/*----------------------------------------------------------------------------*
+ |                                 footprint                                  |
+ *----------------------------------------------------------------------------*/
+
+static size_t
+value_size(const struct rbh_value *value);
+
+static size_t
+id_size(const struct rbh_id *id)
+{
+    return sizeof(*id) + id->size;
+}
+
+static size_t
+value_data_size(const struct rbh_value *value)
+{
+    size_t size = 0;
+
+    switch (value->type) {
+    case RBH_VT_BOOLEAN:
+    case RBH_VT_INT32:
+    case RBH_VT_UINT32:
+    case RBH_VT_INT64:
+    case RBH_VT_UINT64:
+        return 0;
+    case RBH_VT_STRING:
+        return strlen(value->string) + 1;
+    case RBH_VT_BINARY:
+        return value->binary.size;
+    case RBH_VT_REGEX:
+        return strlen(value->regex.string) + 1;
+    case RBH_VT_SEQUENCE:
+        for (size_t i = 0; i < value->sequence.count; i++)
+            size += sizeof(value->sequence.values[i])
+                  + value_data_size(&value->sequence.values[i]);
+        return size;
+    case RBH_VT_MAP:
+        return value_map_size(&value->map);
+    }
+    return 0;
+}
+
+static size_t
+value_size(const struct rbh_value *value)
+{
+    return sizeof(*value) + value_data_size(value);
+}
+
+size_t
+value_map_size(const struct rbh_value_map *map)
+{
+    size_t size = map->count * sizeof(*map->pairs);
+
+    for (size_t i = 0; i < map->count; i++) {
+        size += strlen(map->pairs[i].key) + 1;
+        if (map->pairs[i].value)
+            size += value_size(map->pairs[i].value);
+    }
+    return size;
+}
+
+size_t
+fsevent_size(const struct rbh_fsevent *fsevent)
+{
+    size_t size = id_size(&fsevent->id) + value_map_size(&fsevent->xattrs);
+
+    switch (fsevent->type) {
+    case RBH_FET_UPSERT:
+        if (fsevent->upsert.statx)
+            size += sizeof(*fsevent->upsert.statx);
+        if (fsevent->upsert.symlink)
+            size += strlen(fsevent->upsert.symlink) + 1;
+        break;
+    case RBH_FET_LINK:
+    case RBH_FET_UNLINK:
+        size += id_size(fsevent->link.parent_id) + strlen(fsevent->link.name)
+              + 1;
+        break;
+    case RBH_FET_DELETE:
+        break;
+    case RBH_FET_XATTR:
+        if (fsevent->ns.parent_id)
+            size += id_size(fsevent->ns.parent_id) + strlen(fsevent->ns.name)
+                  + 1;
+        break;
+    }
+    return size;
+}
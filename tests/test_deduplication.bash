@@ -0,0 +1,561 @@
+#!/usr/bin/env bash
+
+# This file is part of rbh-fsevents.
+# Copyright (C) 2023 Commissariat a l'energie atomique et aux energies
+#                    alternatives
+#
+# SPDX-License-Identifer: LGPL-3.0-or-later
+
+test_dir=$(dirname $(readlink -e $0))
+. $test_dir/test_utils.bash
+. $test_dir/yaml_utils.bash
+
+################################################################################
+#                                  UTILITIES                                   #
+################################################################################
+
+# These tests only feed YAML fsevents to rbh-fsevents, they do not need Lustre
+# nor a database.
+setup()
+{
+    testdir=$(mktemp --directory)
+    cd "$testdir"
+}
+
+teardown()
+{
+    rm -rf "$testdir"
+}
+
+deduplicate()
+{
+    rbh_fsevents --batch-size "${batch_size:-100}" - - > output.yaml
+}
+
+################################################################################
+#                                    TESTS                                     #
+################################################################################
+
+test_upsert_merge()
+{
+    {
+        upsert $ID1 "uid: 3"
+        upsert $ID1 "gid: 4" "uid: 5"
+        upsert $ID1 "size: 6"
+    } | deduplicate
+
+    check_fsevents upsert 1
+    check_output "uid: !!int 5"
+    check_output "gid: !!int 4"
+    check_output "size: !!int 6"
+}
+
+test_upsert_distinct_ids()
+{
+    {
+        upsert $ID1 "uid: 3"
+        upsert $ID2 "uid: 4"
+    } | deduplicate
+
+    check_fsevents upsert 2
+}
+
+test_upsert_across_link()
+{
+    {
+        upsert $ID1 "uid: 3"
+        link link $ID1 $PARENT foo
+        link unlink $ID1 $PARENT bar
+        upsert $ID1 "uid: 4"
+    } | deduplicate
+
+    check_fsevents upsert 1
+    check_fsevents link 1
+    check_fsevents unlink 1
+    check_output "uid: !!int 4"
+}
+
+test_upsert_partials_merge()
+{
+    {
+        echo "--- !upsert"
+        echo "id: !!binary $ID1"
+        echo "xattrs: { rbh-fsevents: { statx: !uint32 2 } }"
+        echo "..."
+        echo "--- !upsert"
+        echo "id: !!binary $ID1"
+        echo "xattrs: { rbh-fsevents: { statx: !uint32 4, symlink: readlink } }"
+        echo "..."
+    } | deduplicate
+
+    check_fsevents upsert 1
+    check_output "statx: !uint32 6"
+    check_output "symlink: readlink"
+}
+
+test_inode_xattr_last_writer_wins()
+{
+    {
+        inode_xattr $ID1 "a: !int32 1" "b: !int32 1"
+        link link $ID1 $PARENT foo
+        inode_xattr $ID1 "a: !int32 2" "c: x"
+    } | deduplicate
+
+    check_fsevents inode_xattr 1
+    check_output "a: !int32 2"
+    check_output "b: !int32 1"
+    check_output "c: x"
+}
+
+test_inode_xattr_conflict()
+{
+    {
+        inode_xattr $ID1 "a: !int32 1"
+        echo "--- !upsert"
+        echo "id: !!binary $ID1"
+        echo "xattrs: { a: !int32 2 }"
+        echo "..."
+        inode_xattr $ID1 "a: !int32 3"
+    } | deduplicate
+
+    # The upsert sits between both xattrs and sets the same key
+    check_fsevents inode_xattr 2
+    check_fsevents upsert 1
+}
+
+test_ns_xattr_merge()
+{
+    {
+        ns_xattr $ID1 $PARENT foo /foo
+        ns_xattr $ID1 $PARENT bar /bar
+        ns_xattr $ID1 $PARENT foo /baz
+    } | deduplicate
+
+    check_fsevents ns_xattr 2
+    check_output "path: /bar"
+    check_output "path: /baz"
+    check_no_output "path: /foo"
+}
+
+test_ns_xattr_across_unlink()
+{
+    {
+        ns_xattr $ID1 $PARENT foo /foo
+        link unlink $ID1 $PARENT foo
+        link link $ID1 $PARENT foo
+        ns_xattr $ID1 $PARENT foo /bar
+    } | deduplicate
+
+    check_fsevents ns_xattr 2
+}
+
+test_delete_supersedes()
+{
+    {
+        link link $ID1 $PARENT foo
+        upsert $ID1 "uid: 3"
+        inode_xattr $ID1 "a: !int32 1"
+        ns_xattr $ID1 $PARENT foo /foo
+        upsert $ID2 "uid: 4"
+        link unlink $ID1 $PARENT foo
+        delete $ID1
+    } | deduplicate
+
+    check_fsevents delete 1
+    check_fsevents upsert 1
+    check_fsevents link 0
+    check_fsevents unlink 0
+    check_fsevents inode_xattr 0
+    check_fsevents ns_xattr 0
+}
+
+test_after_delete()
+{
+    {
+        upsert $ID1 "uid: 3"
+        delete $ID1
+        upsert $ID1 "uid: 4"
+    } | deduplicate
+
+    check_fsevents delete 1
+    check_fsevents upsert 1
+    check_output "uid: !!int 4"
+}
+
+{
+    {
+        create $ID1 foo
+        upsert $ID1 "size: 4096"
+        delete $ID1
+    } | deduplicate
+
+    # Only the update of the parent remains
+    check_fsevents upsert 1
+    check_output "id: !!binary $PARENT"
+    check_fsevents link 0
+    check_fsevents inode_xattr 0
+    check_fsevents delete 0
+}
+
+test_delete_existing_entry()
+{
+    {
+        link link $ID1 $PARENT foo
+        upsert $ID1 "size: 4096"
+        delete $ID1
+    } | deduplicate
+
+    check_fsevents delete 1
+    check_fsevents link 0
+}
+
+test_temporary_entry_across_batches()
+{
+    {
+        create $ID1 foo
+        delete $ID1
+    } | batch_size=4 deduplicate
+
+    check_fsevents link 1
+    check_fsevents delete 1
+}
+
+test_acmtime_fold()
+{
+    {
+        create $ID1 foo
+        create $ID2 bar
+        upsert $PARENT "uid: 0"
+        link unlink $ID1 $PARENT foo
+        acmtime $PARENT
+    } | rbh_fsevents --batch-size 100 --stats - - 2> stats.txt > output.yaml
+
+    # The parent's own upsert, and a single timestamp update at the end
+    check_fsevents upsert 4
+    if [[ "$(grep "^id:" output.yaml | tail -n 1)" != "id: !!binary $PARENT" ]]
+    then
+        cat output.yaml
+        error "The timestamps of the parent should be updated last"
+    fi
+
+    if ! grep -q "2 timestamp updates folded" stats.txt; then
+        cat stats.txt
+        error "Two timestamp updates should have been folded"
+    fi
+}
+
+test_acmtime_delete()
+{
+    {
+        acmtime $PARENT
+        delete $PARENT
+    } | deduplicate
+
+    check_fsevents upsert 0
+    check_fsevents delete 1
+}
+
+{
+    {
+        link link $ID1 $PARENT foo
+        ns_xattr $ID1 $PARENT foo /foo
+        ns_xattr $ID1 $PARENT bar /bar
+        link unlink $ID1 $PARENT foo
+    } | deduplicate
+
+    check_fsevents link 0
+    check_fsevents unlink 0
+    check_fsevents ns_xattr 1
+    check_output "path: /bar"
+}
+
+test_unlink_link()
+{
+    {
+        link unlink $ID1 $PARENT foo
+        link link $ID1 $PARENT foo
+    } | deduplicate
+
+    # The namespace entry existed before the batch
+    check_fsevents unlink 1
+    check_fsevents link 1
+}
+
+test_rename_chain()
+{
+    {
+        create $ID1 foo.tmp
+        rename $ID1 foo.tmp foo.1
+        rename $ID1 foo.1 foo
+    } | deduplicate
+
+    check_fsevents link 1
+    check_output "name: foo\$"
+    check_fsevents unlink 0
+    check_fsevents upsert 2
+}
+
+test_rename_existing_entry()
+{
+    {
+        rename $ID1 foo bar
+        rename $ID1 bar baz
+    } | deduplicate
+
+    check_fsevents link 1
+    check_output "name: baz"
+    check_fsevents unlink 1
+    check_output "name: foo"
+}
+
+test_partial_xattrs_merge()
+{
+    {
+        inode_xattr $ID1 "rbh-fsevents: { xattrs: [ user.a ], lustre: {} }"
+        upsert $ID1 "uid: 0"
+        inode_xattr $ID1 "rbh-fsevents: { xattrs: [ user.b, user.a ] }"
+    } | deduplicate
+
+    check_fsevents inode_xattr 1
+    if [[ $(grep -c "user.a" output.yaml) -ne 1 ]]; then
+        cat output.yaml
+        error "user.a should only be enriched once"
+    fi
+    check_output "user.b"
+}
+
+test_partials_across_types()
+{
+    {
+        inode_xattr $ID1 "rbh-fsevents: { lustre: {} }"
+        echo "--- !upsert"
+        echo "id: !!binary $ID1"
+        echo "xattrs: { rbh-fsevents: { statx: !uint32 2, lustre: {} } }"
+        echo "..."
+        echo "--- !upsert"
+        echo "id: !!binary $ID2"
+        echo "xattrs: { rbh-fsevents: { statx: !uint32 2 } }"
+        echo "..."
+        echo "--- !upsert"
+        echo "id: !!binary $ID2"
+        echo "xattrs: { rbh-fsevents: { lustre: {} } }"
+        echo "..."
+        inode_xattr $ID2 "rbh-fsevents: { lustre: {} }"
+    } | deduplicate
+
+    # Each id requests the lustre attributes of its inode once
+    if [[ $(grep -c "lustre:" output.yaml) -ne 2 ]]; then
+        cat output.yaml
+        error "The lustre attributes of each id should only be enriched once"
+    fi
+    check_fsevents upsert 2
+    check_fsevents inode_xattr 1
+}
+
+test_shards()
+{
+    local ids=(AAAAAQ== AAAAAg== AAAABA== AAAABQ== AAAABg== AAAABw== AAAACA==)
+
+    for id in ${ids[@]}; do
+        create $id $id
+        upsert $id "size: 1"
+        rename $id $id foo.$id
+        inode_xattr $id "user.a: $id"
+    done > input.yaml
+
+    rbh_fsevents --batch-size 100 input.yaml - > expected.yaml
+    rbh_fsevents --batch-size 100 --shards 3 input.yaml - > output.yaml
+
+    # Shards only change the order of the fsevents of different ids
+    if ! diff <(sort expected.yaml) <(sort output.yaml); then
+        error "Sharding should not change how fsevents are deduplicated"
+    fi
+    check_same_order expected.yaml output.yaml ${ids[@]} $PARENT
+    check_fsevents link ${#ids[@]}
+    check_fsevents unlink 0
+    check_fsevents upsert $((${#ids[@]} + 1))
+}
+
+test_spill()
+{
+    local ids=(AAAAAQ== AAAAAg== AAAABA== AAAABQ== AAAABg== AAAABw== AAAACA==)
+
+    for id in ${ids[@]}; do
+        create $id $id
+        upsert $id "size: 1"
+        rename $id $id foo.$id
+    done > input.yaml
+    for id in ${ids[@]}; do
+        inode_xattr $id "user.a: $id"
+    done >> input.yaml
+
+    rbh_fsevents --batch-size 100 input.yaml - > expected.yaml
+    rbh_fsevents --batch-size 100 --max-memory 1K --spill-dir . --stats \
+        input.yaml - > output.yaml 2> stats.txt
+
+    if grep -q ' 0 fsevents spilled' stats.txt; then
+        error "Batches should have overflowed to disk"
+    fi
+
+    # Spilled entries come first, but are deduplicated all the same
+    if ! diff <(sort expected.yaml) <(sort output.yaml); then
+        error "Spilling should not change how fsevents are deduplicated"
+    fi
+    check_same_order expected.yaml output.yaml ${ids[@]} $PARENT
+    check_fsevents link ${#ids[@]}
+    check_fsevents unlink 0
+}
+
+test_sliding_window()
+{
+    {
+        upsert $ID1 "uid: 3"
+        upsert $ID2 "uid: 4"
+        upsert $ID1 "gid: 5"
+        delete $ID2
+    } > input.yaml
+
+    # Entries are held across batches until they are due
+    rbh_fsevents --sliding-window --max-delay 3600 --batch-size 1 \
+        input.yaml - > output.yaml
+
+    check_fsevents upsert 1
+    check_fsevents delete 1
+    check_output "uid: !!int 3"
+    check_output "gid: !!int 5"
+}
+
+test_stats()
+{
+    {
+        upsert $ID1 "uid: 3"
+        upsert $ID1 "uid: 4"
+        link link $ID2 $PARENT foo
+        link unlink $ID2 $PARENT foo
+    } | rbh_fsevents --stats - - > output.yaml 2> stats.txt
+
+    local expected=("4 fsevents in, 1 out" "upsert 2/1" "link 1/0"
+                    "1 merged" "1 links cancelled")
+    for stat in "${expected[@]}"; do
+        if ! grep -q "^deduplication: .*$stat" stats.txt; then
+            cat stats.txt
+            error "'$stat' not found in the statistics"
+        fi
+    done
+}
+
+test_batch_boundaries()
+{
+    {
+        upsert $ID1 "uid: 3"
+        upsert $ID1 "uid: 4"
+        delete $ID1
+    } | batch_size=1 deduplicate
+
+    check_fsevents upsert 2
+    check_fsevents delete 1
+}
+
+# Number of batches rbh-fsevents reported in stats.txt
+count_batches()
+{
+    grep -c "^batch:" stats.txt || true
+}
+
+test_max_delay()
+{
+    for uid in 3 4 5; do
+        upsert $ID1 "uid: $uid"
+    done > input.yaml
+
+    rbh_fsevents --max-delay 3600 --batch-stats input.yaml - \
+        > output.yaml 2> stats.txt
+
+    check_fsevents upsert 1
+    check_output "uid: !!int 5"
+    if [[ $(count_batches) -ne 1 ]]; then
+        cat stats.txt
+        error "Batches should not be flushed before they are late"
+    fi
+
+    # Batches are late as soon as they hold an fsevent
+    rbh_fsevents --max-delay 1e-9 --batch-stats input.yaml - \
+        > output.yaml 2> stats.txt
+
+    check_fsevents upsert 3
+    if [[ $(count_batches) -ne 3 ]]; then
+        cat stats.txt
+        error "Every fsevent should have been flushed in a batch of its own"
+    fi
+}
+
+test_min_batch_size()
+{
+    for uid in 3 4 5 6 7; do
+        upsert $ID1 "uid: $uid"
+    done > input.yaml
+
+    # Late batches are only flushed once they hold 2 fsevents, but the source
+    # runs out of fsevents before the last one does.
+    rbh_fsevents --max-delay 1e-9 --min-batch-size 2 --batch-stats \
+        input.yaml - > output.yaml 2> stats.txt
+
+    check_fsevents upsert 3
+    if [[ $(count_batches) -ne 3 ]]; then
+        cat stats.txt
+        error "Fsevents should have been flushed in batches of 2, 2 and 1"
+    fi
+    if [[ $(grep -c "^batch: 2 fsevents in, 1 out" stats.txt) -ne 2 ]]; then
+        cat stats.txt
+        error "Batches should hold at least 2 fsevents"
+    fi
+    check_output "uid: !!int 7"
+}
+
+test_max_memory()
+{
+    for uid in 3 4 5; do
+        upsert $ID1 "uid: $uid"
+    done > input.yaml
+
+    rbh_fsevents --max-memory 1M --batch-stats input.yaml - \
+        > output.yaml 2> stats.txt
+
+    check_fsevents upsert 1
+    if [[ $(count_batches) -ne 1 ]]; then
+        cat stats.txt
+        error "Batches should not be flushed below --max-memory"
+    fi
+
+    # Any fsevent exceeds a single byte
+    rbh_fsevents --max-memory 1 --batch-stats input.yaml - \
+        > output.yaml 2> stats.txt
+
+    check_fsevents upsert 3
+    if [[ $(count_batches) -ne 3 ]]; then
+        cat stats.txt
+        error "Every fsevent should have been flushed in a batch of its own"
+    fi
+    check_output "uid: !!int 3"
+    check_output "uid: !!int 5"
+}
+
+################################################################################
+#                                     MAIN                                     #
+################################################################################
+
+declare -a tests=(test_upsert_merge test_upsert_distinct_ids
+                  test_upsert_across_link test_upsert_partials_merge
+                  test_inode_xattr_last_writer_wins test_inode_xattr_conflict
+                  test_ns_xattr_merge test_ns_xattr_across_unlink
+                  test_delete_supersedes test_after_delete
+                  test_temporary_entry test_delete_existing_entry
+                  test_temporary_entry_across_batches test_acmtime_fold
+                  test_acmtime_delete test_link_unlink test_unlink_link
+                  test_rename_chain test_rename_existing_entry
+                  test_partial_xattrs_merge test_partials_across_types
+                  test_shards test_spill test_sliding_window
+                  test_stats test_batch_boundaries test_max_delay
+                  test_min_batch_size test_max_memory)
+
+run_tests ${tests[@]}
@@ -0,0 +1,148 @@
+#!/usr/bin/env bash
+
+# This file is part of rbh-fsevents
+# Copyright (C) 2023 Commissariat a l'energie atomique et aux energies
+#                    alternatives
+#
+# SPDX-License-Identifer: LGPL-3.0-or-later
+
+test_dir=$(dirname $(readlink -e $0))
+. $test_dir/test_utils.bash
+. $test_dir/yaml_utils.bash
+
+################################################################################
+#                                  UTILITIES                                   #
+################################################################################
+
+# The id of the entry linked as $1, as recorded in the changelog
+entry_id()
+{
+    rbh_fsevents --lustre "$LUSTRE_MDT" - |
+        awk -v name="name: $1" '/^id: / { id = $3 } $0 == name { print id; exit }'
+}
+
+# An upsert of id $1 that requests the partial fields $2
+partial_upsert()
+{
+    echo "--- !upsert"
+    echo "id: !!binary $1"
+    echo "xattrs: { rbh-fsevents: { $2 } }"
+    echo "..."
+}
+
+enrich()
+{
+    rbh_fsevents --enrich rbh:lustre:"$LUSTRE_DIR" --stats "$@" - - \
+        > output.yaml 2> stats.txt
+}
+
+# Check the enrichment statistics in stats.txt: $1 lookups, $2 descriptor cache
+# hits, $3 negative cache hits, $4 opens and $5 skipped fsevents
+check_enrichment()
+{
+    local expected="^enrichment: $1 lookups, $2 descriptor cache hits .*, "
+    expected+="$3 negative cache hits .*, $4 opens, $5 fsevents skipped\$"
+
+    if ! grep -q -- "$expected" stats.txt; then
+        cat stats.txt
+        error "Expected $1 lookups, $2 descriptor cache hits, $3 negative" \
+              "cache hits, $4 opens and $5 skipped fsevents"
+    fi
+}
+
+################################################################################
+#                                    TESTS                                     #
+################################################################################
+
+test_single_open()
+{
+    local entry="test_file"
+    touch "$entry"
+
+    local id=$(entry_id "$entry")
+    partial_upsert $id "statx: !uint32 $ACMTIME, lustre: {}" | enrich
+
+    # Every partial field is enriched through the same descriptor
+    check_fsevents upsert 1
+    check_enrichment 1 0 0 1 0
+}
+
+test_descriptor_cache()
+{
+    local entry="test_file"
+    touch "$entry"
+
+    local id=$(entry_id "$entry")
+
+    # Fsevents in distinct batches are not merged
+    for i in 1 2; do
+        partial_upsert $id "statx: !uint32 $ACMTIME"
+    done | enrich --batch-size 1
+
+    check_fsevents upsert 2
+    check_enrichment 2 1 0 1 0
+
+    # Descriptors that allow I/O are not kept across fsevents
+    for i in 1 2; do
+        partial_upsert $id "lustre: {}"
+    done | enrich --batch-size 1
+
+    check_fsevents upsert 2
+    check_enrichment 2 0 0 2 0
+}
+
+test_negative_cache()
+{
+    local entry="test_file"
+    touch "$entry"
+
+    local id=$(entry_id "$entry")
+    rm "$entry"
+
+    for i in 1 2; do
+        partial_upsert $id "statx: !uint32 $ACMTIME"
+    done > input.yaml
+
+    # The fsevents of deleted entries are skipped, the second one without
+    # trying to open the entry again
+    enrich --batch-size 1 < input.yaml
+    check_fsevents upsert 0
+    check_enrichment 2 0 1 1 2
+
+    enrich --batch-size 1 --negative-ttl 0 < input.yaml
+    check_fsevents upsert 0
+    check_enrichment 2 0 0 2 2
+
+    # Entries are only known missing for --negative-ttl
+    enrich --batch-size 1 --negative-ttl 1e-9 < input.yaml
+    check_fsevents upsert 0
+    check_enrichment 2 0 0 2 2
+
+    # Skipped fsevents are also reported batch by batch
+    enrich --batch-size 1 --max-delay 1e-9 --batch-stats < input.yaml
+    local skipped="$(grep -c "^batch enrichment: .*, 1 fsevents skipped\$" \
+                          stats.txt || true)"
+    if [[ $skipped -ne 2 ]]; then
+        cat stats.txt
+        error "Expected 2 batches with 1 skipped fsevent each"
+    fi
+}
+
+################################################################################
+#                                     MAIN                                     #
+################################################################################
+
+declare -a tests=(test_single_open test_descriptor_cache test_negative_cache)
+
+LUSTRE_DIR=/mnt/lustre/
+cd "$LUSTRE_DIR"
+
+LUSTRE_MDT=lustre-MDT0000
+userid="$(start_changelogs "$LUSTRE_MDT")"
+
+tmpdir=$(mktemp --directory --tmpdir=$LUSTRE_DIR)
+lfs setdirstripe -D -i 0 $tmpdir
+trap -- "rm -rf '$tmpdir'; stop_changelogs '$LUSTRE_MDT' '$userid'" EXIT
+cd "$tmpdir"
+
+run_tests ${tests[@]}
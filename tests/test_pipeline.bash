@@ -0,0 +1,87 @@
+#!/usr/bin/env bash
+
+# This file is part of rbh-fsevents.
+# Copyright (C) 2023 Commissariat a l'energie atomique et aux energies
+#                    alternatives
+#
+# SPDX-License-Identifer: LGPL-3.0-or-later
+
+test_dir=$(dirname $(readlink -e $0))
+. $test_dir/test_utils.bash
+. $test_dir/yaml_utils.bash
+
+################################################################################
+#                                  UTILITIES                                   #
+################################################################################
+
+# These tests only feed YAML fsevents to rbh-fsevents, they do not need Lustre
+# nor a database.
+setup()
+{
+    testdir=$(mktemp --directory)
+    cd "$testdir"
+}
+
+teardown()
+{
+    rm -rf "$testdir"
+}
+
+IDS=(AAAAAQ== AAAAAg== AAAABA== AAAABQ== AAAABg== AAAABw== AAAACA==)
+
+# Several fsevents per id, spread across batches of --batch-size 5
+generate_input()
+{
+    for id in ${IDS[@]}; do
+        create $id $id
+        upsert $id "size: 1"
+    done
+    for id in ${IDS[@]}; do
+        rename $id $id foo.$id
+        inode_xattr $id "user.a: $id"
+    done
+}
+
+################################################################################
+#                                    TESTS                                     #
+################################################################################
+
+test_threads()
+{
+    generate_input > input.yaml
+
+    rbh_fsevents --batch-size 5 input.yaml - > expected.yaml
+    rbh_fsevents --batch-size 5 --threads 2 input.yaml - > output.yaml
+
+    # Stages run concurrently, but batches still go through them in order
+    if ! diff expected.yaml output.yaml; then
+        error "Running stages on threads should not change the output"
+    fi
+}
+
+test_enrichment_pool()
+{
+    generate_input > input.yaml
+
+    rbh_fsevents --batch-size 5 input.yaml - > expected.yaml
+
+    # Fsevents are spread across 1, 2 and 4 enrichment workers by id, and
+    # collected back in the order of their batch.
+    for threads in 3 4 6; do
+        rbh_fsevents --batch-size 5 --threads $threads input.yaml - \
+            > output.yaml
+
+        if ! diff expected.yaml output.yaml; then
+            error "Enriching fsevents on $((threads - 2)) threads should not" \
+                  "change the output"
+        fi
+    done
+}
+
+################################################################################
+#                                     MAIN                                     #
+################################################################################
+
+declare -a tests=(test_threads test_enrichment_pool)
+
+run_tests ${tests[@]}
@@ -0,0 +1,178 @@
+#!/usr/bin/env bash
+
+# This file is part of rbh-fsevents.
+# Copyright (C) 2023 Commissariat a l'energie atomique et aux energies
+#                    alternatives
+#
+# SPDX-License-Identifer: LGPL-3.0-or-later
+
+# Utilities for the tests that feed YAML fsevents to rbh-fsevents and check
+# what it outputs, in output.yaml
+
+################################################################################
+#                                OUTPUT CHECKS                                 #
+################################################################################
+
+count_fsevents()
+{
+    grep -c -- "^--- !$1\$" output.yaml || true
+}
+
+check_fsevents()
+{
+    local tag="$1"
+    local expected="$2"
+    local count=$(count_fsevents "$tag")
+
+    if [[ $count -ne $expected ]]; then
+        cat output.yaml
+        error "There should be $expected '$tag' fsevents, found $count"
+    fi
+}
+
+check_output()
+{
+    if ! grep -q -- "$1" output.yaml; then
+        cat output.yaml
+        error "'$1' not found in the output"
+    fi
+}
+
+check_no_output()
+{
+    if grep -q -- "$1" output.yaml; then
+        cat output.yaml
+        error "'$1' should not be in the output"
+    fi
+}
+
+# The YAML documents of the fsevents of id $1 in $2, in order
+documents_of()
+{
+    awk -v id="id: !!binary $1" '
+        /^--- / {
+            if (found)
+                printf "%s", document
+            document = ""
+            found = 0
+        }
+        { document = document $0 "\n" }
+        $0 == id { found = 1 }
+        END {
+            if (found)
+                printf "%s", document
+        }
+    ' "$2"
+}
+
+# Check that the fsevents of each id in $3... are the same, and in the same
+# order, in $1 and $2; the fsevents of distinct ids may be ordered differently
+check_same_order()
+{
+    local expected="$1"
+    local output="$2"
+    shift 2
+
+    for id in "$@"; do
+        if ! diff <(documents_of $id "$expected") <(documents_of $id "$output")
+        then
+            error "The fsevents of $id should be the same, in the same order"
+        fi
+    done
+}
+
+################################################################################
+#                                   FSEVENTS                                   #
+################################################################################
+
+ID1=AAAAAQ==
+ID2=AAAAAg==
+PARENT=AAAAAw==
+
+upsert()
+{
+    local id="$1"
+    shift
+
+    echo "--- !upsert"
+    echo "id: !!binary $id"
+    echo "xattrs: {}"
+    echo "statx:"
+    for field in "$@"; do
+        echo "    $field"
+    done
+    echo "..."
+}
+
+link()
+{
+    echo "--- !$1"
+    echo "id: !!binary $2"
+    echo "xattrs: {}"
+    echo "parent: !!binary $3"
+    echo "name: $4"
+    echo "..."
+}
+
+inode_xattr()
+{
+    local id="$1"
+    shift
+
+    echo "--- !inode_xattr"
+    echo "id: !!binary $id"
+    echo "xattrs:"
+    for xattr in "$@"; do
+        echo "    $xattr"
+    done
+    echo "..."
+}
+
+ns_xattr()
+{
+    echo "--- !ns_xattr"
+    echo "id: !!binary $1"
+    echo "xattrs:"
+    echo "    path: $4"
+    echo "parent: !!binary $2"
+    echo "name: $3"
+    echo "..."
+}
+
+delete()
+{
+    echo "--- !delete"
+    echo "id: !!binary $1"
+    echo "..."
+}
+
+# RBH_STATX_ATIME | RBH_STATX_CTIME | RBH_STATX_MTIME
+ACMTIME=369098976
+
+acmtime()
+{
+    echo "--- !upsert"
+    echo "id: !!binary $1"
+    echo "xattrs: { rbh-fsevents: { statx: !uint32 $ACMTIME } }"
+    echo "..."
+}
+
+# The fsevents the Lustre source emits for a CL_CREATE record
+create()
+{
+    link link $1 $PARENT $2
+    inode_xattr $1 "fid: !!binary $1" "rbh-fsevents: { lustre: {} }"
+    upsert $1 "uid: 0"
+    acmtime $PARENT
+}
+
+# The fsevents the Lustre source emits for a CL_RENAME record that does not
+# overwrite its target
+rename()
+{
+    link link $1 $PARENT $3
+    upsert $1 "uid: 0"
+    acmtime $PARENT
+    link unlink $1 $PARENT $2
+    acmtime $PARENT
+}